@@ -0,0 +1,206 @@
+#include "hdrmerge.h"
+#include <fstream>
+#include <ctime>
+
+#if defined(_WIN32)
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+
+namespace fs = boost::filesystem;
+
+/* Each cache entry contains a manifest, which maps the stored copies
+   ("0", "1", ..) back to the names of the output files */
+static const char *manifest_name = "manifest.txt";
+
+/* Hit/miss counters that are accumulated over all runs */
+static const char *stats_name = "stats.txt";
+
+/// Copy a file, replacing the target if it already exists
+static void copyFile(const fs::path &source, const fs::path &target) {
+    if (fs::exists(target))
+        fs::remove(target);
+    fs::copy_file(source, target);
+}
+
+/// Read the hit/miss counters of a cache
+static void readStatistics(const std::string &filename, uint64_t &hits, uint64_t &misses) {
+    std::ifstream is(filename.c_str());
+    std::string key;
+    uint64_t value;
+    hits = misses = 0;
+    while (is >> key >> value) {
+        if (key == "hits")
+            hits = value;
+        else if (key == "misses")
+            misses = value;
+    }
+}
+
+ResultCache::ResultCache(const std::string &path, uint64_t maxSize)
+ : m_path(path), m_maxSize(maxSize) {
+    if (!fs::exists(m_path))
+        fs::create_directories(m_path);
+}
+
+uint64_t ResultCache::hashFile(const std::string &filename, bool content, uint64_t hash) {
+    if (!content) {
+        /* Identify the file by its location, size and modification time */
+        hash = fnv1a(fs::absolute(filename).string(), hash);
+        uint64_t size = (uint64_t) fs::file_size(filename),
+                 mtime = (uint64_t) fs::last_write_time(filename);
+        hash = fnv1a(&size, sizeof(uint64_t), hash);
+        return fnv1a(&mtime, sizeof(uint64_t), hash);
+    }
+
+    /* Only the contents matter, so that moved or copied files still hit the cache */
+    std::ifstream is(filename.c_str(), std::ios::binary);
+    if (!is.good())
+        throw std::runtime_error("Unable to read \"" + filename + "\"!");
+    std::vector<char> buffer(1 << 20);
+    uint64_t size = 0;
+    while (is.good()) {
+        is.read(&buffer[0], buffer.size());
+        hash = fnv1a(&buffer[0], (size_t) is.gcount(), hash);
+        size += (uint64_t) is.gcount();
+    }
+    /* Terminate with the length, so that consecutive files can't be confused */
+    return fnv1a(&size, sizeof(uint64_t), hash);
+}
+
+std::string ResultCache::entryPath(uint64_t key) const {
+    return (fs::path(m_path) / (boost::format("%016x") % key).str()).string();
+}
+
+bool ResultCache::restore(uint64_t key) {
+    fs::path entry(entryPath(key));
+    std::ifstream manifest((entry / manifest_name).string().c_str());
+    if (!manifest.good()) {
+        updateStatistics(false);
+        return false;
+    }
+
+    std::vector<std::pair<std::string, std::string>> files;
+    std::string line;
+    while (std::getline(manifest, line)) {
+        size_t pos = line.find(' ');
+        if (pos == std::string::npos)
+            continue;
+        files.push_back(std::make_pair((entry / line.substr(0, pos)).string(), line.substr(pos+1)));
+    }
+
+    try {
+        for (size_t i=0; i<files.size(); ++i) {
+            cout << "Restoring \"" << files[i].second << "\" from the cache .." << endl;
+            copyFile(files[i].first, files[i].second);
+        }
+    } catch (const fs::filesystem_error &ex) {
+        cerr << "Warning: unable to restore the cache entry \"" << entry.string()
+             << "\" (" << ex.what() << ")" << endl;
+        updateStatistics(false);
+        return false;
+    }
+
+    /* Mark the entry as recently used */
+    fs::last_write_time(entry, std::time(NULL));
+    updateStatistics(true);
+    return true;
+}
+
+void ResultCache::store(uint64_t key, const std::vector<std::string> &files) {
+    fs::path entry(entryPath(key));
+    fs::path temp(entry.string() + (boost::format(".tmp%i") % getpid()).str());
+
+    try {
+        /* Assemble the entry under a temporary name, so that other processes never see partial entries */
+        fs::create_directories(temp);
+        std::ofstream manifest((temp / manifest_name).string().c_str());
+        for (size_t i=0; i<files.size(); ++i) {
+            copyFile(files[i], temp / boost::lexical_cast<std::string>(i));
+            manifest << i << " " << files[i] << endl;
+        }
+        manifest.close();
+
+        if (fs::exists(entry))
+            fs::remove_all(entry);
+        fs::rename(temp, entry);
+    } catch (const fs::filesystem_error &ex) {
+        cerr << "Warning: unable to store the results in the cache (" << ex.what() << ")" << endl;
+        boost::system::error_code ec;
+        fs::remove_all(temp, ec);
+        return;
+    }
+
+    evict(entry.string());
+}
+
+void ResultCache::evict(const std::string &keep) {
+    if (m_maxSize == 0)
+        return;
+
+    /* Collect the entries along with their size and the time of their last use */
+    std::vector<std::pair<std::time_t, std::pair<fs::path, uint64_t>>> entries;
+    uint64_t total = 0;
+    for (fs::directory_iterator it(m_path); it != fs::directory_iterator(); ++it) {
+        if (!fs::is_directory(it->path()) || !fs::exists(it->path() / manifest_name))
+            continue;
+        uint64_t size = 0;
+        for (fs::directory_iterator it2(it->path()); it2 != fs::directory_iterator(); ++it2)
+            size += (uint64_t) fs::file_size(it2->path());
+        total += size;
+        if (it->path() == fs::path(keep))
+            continue;
+        entries.push_back(std::make_pair(fs::last_write_time(it->path()), std::make_pair(it->path(), size)));
+    }
+
+    std::sort(entries.begin(), entries.end());
+    for (size_t i=0; i<entries.size() && total > m_maxSize; ++i) {
+        cout << "Evicting the least recently used cache entry \""
+             << entries[i].second.first.filename().string() << "\"" << endl;
+        boost::system::error_code ec;
+        fs::remove_all(entries[i].second.first, ec);
+        total -= entries[i].second.second;
+    }
+}
+
+void ResultCache::updateStatistics(bool hit) {
+    std::string filename = (fs::path(m_path) / stats_name).string();
+    uint64_t hits, misses;
+    readStatistics(filename, hits, misses);
+
+    if (hit)
+        ++hits;
+    else
+        ++misses;
+
+    std::ofstream os(filename.c_str());
+    os << "hits " << hits << endl << "misses " << misses << endl;
+}
+
+void ResultCache::printStatistics() const {
+    uint64_t hits, misses, size = 0;
+    size_t count = 0;
+    readStatistics((fs::path(m_path) / stats_name).string(), hits, misses);
+
+    for (fs::directory_iterator it(m_path); it != fs::directory_iterator(); ++it) {
+        if (!fs::is_directory(it->path()) || !fs::exists(it->path() / manifest_name))
+            continue;
+        for (fs::directory_iterator it2(it->path()); it2 != fs::directory_iterator(); ++it2)
+            size += (uint64_t) fs::file_size(it2->path());
+        ++count;
+    }
+
+    cout << "Result cache \"" << m_path << "\": " << count << " entries, "
+         << boost::format("%.1f") % (size / (1024.0 * 1024.0)) << " MiB";
+    if (m_maxSize > 0)
+        cout << boost::format(" (limit: %.1f MiB)") % (m_maxSize / (1024.0 * 1024.0));
+    cout << ", " << hits << " hits, " << misses << " misses";
+    if (hits + misses > 0)
+        cout << boost::format(" (hit rate: %.1f%%)") % (100.0 * hits / (hits + misses));
+    cout << endl;
+}
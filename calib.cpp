@@ -0,0 +1,377 @@
+#include "hdrmerge.h"
+#include <string.h>
+#include <fstream>
+#include <sstream>
+#include <set>
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+#include <half.h>
+
+namespace fs = boost::filesystem;
+
+/* Header of a cached master dark frame. The header is followed by
+   width*height half precision values, which store the mean dark
+   signal above the black level (in raw sensor units) */
+struct DarkFrameHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t frames;
+    float blacklevel;
+};
+
+static const char *darkframe_magic = "HDRMDARK";
+
+/// Turn an arbitrary string into something that can be used as part of a file name
+static std::string sanitize(const std::string &str) {
+    std::string result;
+    for (size_t i=0; i<str.length(); ++i) {
+        char c = str[i];
+        result += std::isalnum((unsigned char) c) || c == '.' || c == '-' ? c : '_';
+    }
+    return result;
+}
+
+/// Return the cache file name of the master dark for a certain camera, ISO speed and exposure time
+static std::string darkFramePath(const std::string &cacheDir, const Exposure &exp) {
+    return (fs::path(cacheDir) / (boost::format("dark_%s_iso%g_%.6gs.bin")
+        % sanitize(exp.serial) % exp.isoSpeed % exp.exposure).str()).string();
+}
+
+/// Try to load a cached master dark (returns NULL if unavailable or incompatible)
+static float *readDarkFrame(const std::string &filename, size_t width, size_t height,
+        size_t frames, float blacklevel) {
+    std::ifstream is(filename.c_str(), std::ios::binary);
+    if (!is.good())
+        return NULL;
+
+    DarkFrameHeader header;
+    is.read((char *) &header, sizeof(DarkFrameHeader));
+    if (!is.good() || memcmp(header.magic, darkframe_magic, 8) != 0 || header.version != 1) {
+        cerr << "Warning: ignoring the invalid cached dark frame \"" << filename << "\"" << endl;
+        return NULL;
+    }
+
+    if (header.width != width || header.height != height) {
+        cerr << "Warning: ignoring the cached dark frame \"" << filename << "\" (its resolution "
+             << header.width << "x" << header.height << " does not match)" << endl;
+        return NULL;
+    }
+
+    if (header.frames != frames || header.blacklevel != blacklevel) {
+        cerr << "Warning: ignoring the outdated cached dark frame \"" << filename << "\" (it was made from "
+             << header.frames << " frames with a black level of " << header.blacklevel << ", but there are now "
+             << frames << " frames with a black level of " << blacklevel << ")" << endl;
+        return NULL;
+    }
+
+    half *buffer = new half[width*height];
+    is.read((char *) buffer, sizeof(half) * width * height);
+    if (!is.good()) {
+        cerr << "Warning: ignoring the truncated cached dark frame \"" << filename << "\"" << endl;
+        delete[] buffer;
+        return NULL;
+    }
+
+    float *dark = new float[width*height];
+    for (size_t i=0; i<width*height; ++i)
+        dark[i] = buffer[i];
+    delete[] buffer;
+
+    cout << "Using the cached master dark \"" << filename << "\" ("
+         << header.frames << " frames)" << endl;
+
+    return dark;
+}
+
+/// Store a master dark in the cache
+static void writeDarkFrame(const std::string &filename, const float *dark,
+        size_t width, size_t height, size_t frames, float blacklevel) {
+    DarkFrameHeader header;
+    memcpy(header.magic, darkframe_magic, 8);
+    header.version = 1;
+    header.width = (uint32_t) width;
+    header.height = (uint32_t) height;
+    header.frames = (uint32_t) frames;
+    header.blacklevel = blacklevel;
+
+    half *buffer = new half[width*height];
+    for (size_t i=0; i<width*height; ++i)
+        buffer[i] = dark[i];
+
+    std::ofstream os(filename.c_str(), std::ios::binary);
+    os.write((const char *) &header, sizeof(DarkFrameHeader));
+    os.write((const char *) buffer, sizeof(half) * width * height);
+    delete[] buffer;
+
+    if (!os.good())
+        cerr << "Warning: unable to write the master dark \"" << filename << "\"" << endl;
+    else
+        cout << "Cached the master dark in \"" << filename << "\"" << endl;
+}
+
+/// Return the directory that holds the master darks (by default, the one containing the dark frames)
+static std::string darkCacheDir(const ExposureSeries &darks, const std::string &cacheDir) {
+    std::string result = cacheDir;
+    if (result.empty())
+        result = fs::path(darks.exposures[0].filename).parent_path().string();
+    if (result.empty())
+        result = ".";
+    return result;
+}
+
+std::vector<std::string> ExposureSeries::darkFrameFiles(const std::string &fmt, const std::string &cacheDir_) const {
+    std::unique_ptr<ExposureSeries> darks_ptr(new ExposureSeries());
+    ExposureSeries &darks = *darks_ptr;
+    darks.add(fmt);
+    if (darks.size() == 0)
+        throw std::runtime_error("No dark frames found for \"" + fmt + "\"!");
+    darks.readExposureInfo();
+
+    std::string cacheDir = darkCacheDir(darks, cacheDir_);
+    std::vector<std::string> files;
+    std::set<std::string> masters;
+    for (size_t i=0; i<darks.size(); ++i) {
+        const Exposure &exp = darks.exposures[i];
+        files.push_back(exp.filename);
+        if (exp.serial == "unknown")
+            continue;
+        std::string filename = darkFramePath(cacheDir, exp);
+        if (fs::exists(filename))
+            masters.insert(filename);
+    }
+    files.insert(files.end(), masters.begin(), masters.end());
+    return files;
+}
+
+void ExposureSeries::loadDarkFrames(const std::string &fmt, const std::string &cacheDir_) {
+    std::unique_ptr<ExposureSeries> darks_ptr(new ExposureSeries());
+    ExposureSeries &darks = *darks_ptr;
+    darks.add(fmt);
+    if (darks.size() == 0)
+        throw std::runtime_error("No dark frames found for \"" + fmt + "\"!");
+    darks.readExposureInfo();
+
+    std::string cacheDir = darkCacheDir(darks, cacheDir_);
+    if (!fs::exists(cacheDir))
+        fs::create_directories(cacheDir);
+
+    /* Group the dark frames by camera, ISO speed and exposure time */
+    typedef std::map<std::string, std::vector<size_t>> GroupMap;
+    GroupMap groups;
+    for (size_t i=0; i<darks.size(); ++i) {
+        const Exposure &exp = darks.exposures[i];
+        if (exp.isoSpeed != isoSpeed) {
+            cerr << "Warning: ignoring the dark frame \"" << exp.filename << "\" (ISO "
+                 << exp.isoSpeed << " instead of " << isoSpeed << ")" << endl;
+            continue;
+        }
+        if (exp.serial != exposures[0].serial)
+            cerr << "Warning: the dark frame \"" << exp.filename << "\" was taken with a different "
+                 << "camera (serial number " << exp.serial << ")" << endl;
+        groups[darkFramePath(cacheDir, exp)].push_back(i);
+    }
+
+    if (groups.empty())
+        throw std::runtime_error("None of the dark frames are compatible with the exposure series!");
+
+    /* Match the exposures against the available dark frame exposure times */
+    std::map<std::string, std::vector<size_t>> assignment;
+    for (size_t img=0; img<exposures.size(); ++img) {
+        const Exposure &exp = exposures[img];
+        std::string match;
+
+        for (GroupMap::const_iterator it = groups.begin(); it != groups.end(); ++it) {
+            float darkExposure = darks.exposures[it->second[0]].exposure;
+            if (std::abs((darkExposure - exp.exposure) / exp.exposure) < 1e-3f)
+                match = it->first;
+        }
+
+        if (match.empty() && groups.size() == 1) {
+            match = groups.begin()->first;
+            cerr << "Warning: no dark frame with an exposure time of " << exp.toString()
+                 << " was found -- using the " << darks.exposures[groups.begin()->second[0]].toString()
+                 << " dark frame instead." << endl;
+        } else if (match.empty()) {
+            cerr << "Warning: no dark frame with an exposure time of " << exp.toString()
+                 << " was found -- not subtracting any dark signal from this exposure." << endl;
+            continue;
+        }
+
+        assignment[match].push_back(img);
+    }
+
+    float normalization = 1.0f / (whitepoint - blacklevel);
+    for (auto it = assignment.begin(); it != assignment.end(); ++it) {
+        const std::string &filename = it->first;
+        const std::vector<size_t> &group = groups[filename];
+
+        /* Without a serial number, master darks of different camera bodies can't be told apart */
+        const std::string &serial = darks.exposures[group[0]].serial;
+        bool cached = serial != "unknown";
+        if (!cached)
+            cerr << "Warning: the dark frames don't record the camera serial number -- not caching "
+                 << "the master dark \"" << filename << "\"" << endl;
+
+        float *dark = cached ? readDarkFrame(filename, width, height, group.size(), (float) blacklevel) : NULL;
+
+        if (!dark) {
+            /* Not cached yet -- decode and average all frames of this group */
+            std::unique_ptr<ExposureSeries> series_ptr(new ExposureSeries());
+            ExposureSeries &series = *series_ptr;
+            for (size_t i=0; i<group.size(); ++i)
+                series.exposures.push_back(Exposure(darks.exposures[group[i]].filename));
+            series.load();
+
+            if (series.width != width || series.height != height)
+                throw std::runtime_error("The resolution of the dark frames does not match the exposure series!");
+
+            dark = new float[width*height];
+            float scale = 1.0f / series.size(), black = (float) series.blacklevel;
+
+            #pragma omp parallel for
+            for (int y=0; y<height; ++y) {
+                size_t offset = y * width;
+                for (size_t x=0; x<width; ++x) {
+                    float value = 0;
+                    for (size_t i=0; i<series.size(); ++i)
+                        value += series.exposures[i].image[offset];
+                    dark[offset++] = value * scale - black;
+                }
+            }
+
+            if (cached)
+                writeDarkFrame(filename, dark, width, height, series.size(), black);
+        }
+
+        /* Convert to the units of value_tbl */
+        #pragma omp parallel for
+        for (int y=0; y<height; ++y) {
+            float *ptr = dark + y * width;
+            for (size_t x=0; x<width; ++x)
+                *ptr++ *= normalization;
+        }
+
+        darkframes.push_back(dark);
+        for (size_t i=0; i<it->second.size(); ++i)
+            exposures[it->second[i]].dark = dark;
+    }
+}
+
+GainMap::GainMap(size_t width, size_t height, float a, float b, float c) {
+    /* Tabulate the correction roughly every 1/64th of the image size */
+    double cellSize = std::max(width, height) / 64.0;
+    resX = std::max((size_t) 2, (size_t) std::ceil(width / cellSize) + 1);
+    resY = std::max((size_t) 2, (size_t) std::ceil(height / cellSize) + 1);
+
+    double center_x = width / 2.0, center_y = height / 2.0;
+    double size_scale = 1.0 / std::max(width, height);
+
+    data.resize(resX * resY);
+    for (size_t j=0; j<resY; ++j) {
+        double dy = (j * height / (double) (resY-1) - center_y) * size_scale, dy2 = dy*dy;
+        for (size_t i=0; i<resX; ++i) {
+            double dx = (i * width / (double) (resX-1) - center_x) * size_scale, dx2 = dx*dx;
+            double dist2 = dx2+dy2, dist4 = dist2*dist2, dist6 = dist4*dist2;
+            data[j*resX + i] = (float) (1.0 / (1.0 + dist2*a + dist4*b + dist6*c));
+        }
+    }
+
+    /* Precompute the interpolation indices and weights of all rows and columns */
+    xIndex.resize(width); xWeight.resize(width);
+    for (size_t x=0; x<width; ++x) {
+        double u = (x + 0.5) / width * (resX-1);
+        xIndex[x] = (uint32_t) std::min((size_t) u, resX-2);
+        xWeight[x] = (float) (u - xIndex[x]);
+    }
+
+    yIndex.resize(height); yWeight.resize(height);
+    for (size_t y=0; y<height; ++y) {
+        double v = (y + 0.5) / height * (resY-1);
+        yIndex[y] = (uint32_t) std::min((size_t) v, resY-2);
+        yWeight[y] = (float) (v - yIndex[y]);
+    }
+}
+
+void GainMap::row(size_t y, float *buffer) const {
+    const float *row0 = &data[yIndex[y] * resX], *row1 = row0 + resX;
+    float t = yWeight[y];
+    for (size_t i=0; i<resX; ++i)
+        buffer[i] = row0[i] * (1-t) + row1[i] * t;
+}
+
+/**
+ * Return the flat-field cache file name for the camera model, lens, focal length
+ * and aperture of an exposure. Returns an empty string when the EXIF tags don't
+ * identify the camera and lens, since unrelated lenses would otherwise share
+ * the same cache entry
+ */
+static std::string flatFieldPath(const std::string &cacheDir, const StringMap &metadata, const Exposure &exp) {
+    StringMap::const_iterator it = metadata.find("Exif.Image.Model");
+    if (it == metadata.end() || it->second.empty() || exp.lens == "unknown" || exp.focalLength <= 0)
+        return "";
+
+    return (fs::path(cacheDir) / (boost::format("flatfield_%s_%s_%gmm_f%g.cfg")
+        % sanitize(it->second) % sanitize(exp.lens) % exp.focalLength % exp.aperture).str()).string();
+}
+
+/// Warn that the flat-field cache can't be used for an exposure series
+static void flatFieldWarning() {
+    cerr << "Warning: the EXIF data does not record the camera model, lens and focal length "
+         << "-- not using the flat-field cache" << endl;
+}
+
+std::string ExposureSeries::flatFieldFile(const std::string &cacheDir) const {
+    return flatFieldPath(cacheDir, metadata, exposures[0]);
+}
+
+bool ExposureSeries::loadFlatField(const std::string &cacheDir, float *coeffs) const {
+    std::string filename = flatFieldFile(cacheDir);
+    if (filename.empty()) {
+        flatFieldWarning();
+        return false;
+    }
+
+    std::ifstream is(filename.c_str());
+    if (!is.good())
+        return false;
+
+    std::string line;
+    while (std::getline(is, line)) {
+        if (line.compare(0, 6, "vcorr=") != 0)
+            continue;
+        std::replace(line.begin(), line.end(), ',', ' ');
+        std::istringstream iss(line.substr(6));
+        if (!(iss >> coeffs[0] >> coeffs[1] >> coeffs[2]))
+            break;
+        cout << "Using the cached vignetting correction \"" << filename << "\"" << endl;
+        return true;
+    }
+
+    cerr << "Warning: ignoring the invalid flat-field cache entry \"" << filename << "\"" << endl;
+    return false;
+}
+
+void ExposureSeries::saveFlatField(const std::string &cacheDir, const float *coeffs) const {
+    if (!fs::exists(cacheDir))
+        fs::create_directories(cacheDir);
+
+    const Exposure &exp = exposures[0];
+    std::string filename = flatFieldFile(cacheDir);
+    if (filename.empty()) {
+        flatFieldWarning();
+        return;
+    }
+
+    std::ofstream os(filename.c_str());
+    os.precision(10);
+    os << "# Vignetting correction for \"" << exp.lens << "\" on the \""
+       << metadata.find("Exif.Image.Model")->second << "\" at "
+       << exp.focalLength << "mm, f/" << exp.aperture << endl
+       << "vcorr=" << coeffs[0] << ", " << coeffs[1] << ", " << coeffs[2] << endl;
+
+    if (!os.good())
+        cerr << "Warning: unable to write the flat-field cache entry \"" << filename << "\"" << endl;
+    else
+        cout << "Cached the vignetting correction in \"" << filename << "\"" << endl;
+}
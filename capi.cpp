@@ -0,0 +1,205 @@
+#include "hdrmerge.h"
+#include "hdrmerge_c.h"
+#include <string.h>
+
+struct hdrmerge_series {
+    ExposureSeries es;
+
+    /* Also set by the functions that take a const series */
+    mutable std::string error;
+};
+
+/// Sensor to XYZ transformation used when none is given (sRGB primaries)
+static const float default_sensor2xyz[9] = {
+    0.412453f, 0.357580f, 0.180423f,
+    0.212671f, 0.715160f, 0.072169f,
+    0.019334f, 0.119193f, 0.950227f
+};
+
+/// Run 'f' and turn any exception into an error code (works with const and non-const series)
+template <typename Series, typename Functor> static int guard(Series *series, Functor f) {
+    if (!series)
+        return HDRMERGE_ERROR;
+    series->error.clear();
+    try {
+        f(series->es);
+        return HDRMERGE_OK;
+    } catch (const std::exception &ex) {
+        series->error = ex.what();
+    } catch (...) {
+        series->error = "Unknown error";
+    }
+    return HDRMERGE_ERROR;
+}
+
+/// Copy a user-specified matrix (the implementation expects a modifiable array)
+static void sensorMatrix(const float *sensor2xyz, float *result) {
+    memcpy(result, sensor2xyz ? sensor2xyz : default_sensor2xyz, sizeof(float) * 9);
+}
+
+extern "C" {
+
+int hdrmerge_api_version(void) {
+    return HDRMERGE_API_VERSION;
+}
+
+hdrmerge_series *hdrmerge_create(void) {
+    try {
+        return new hdrmerge_series();
+    } catch (...) {
+        return NULL;
+    }
+}
+
+void hdrmerge_destroy(hdrmerge_series *series) {
+    delete series;
+}
+
+const char *hdrmerge_last_error(const hdrmerge_series *series) {
+    return series ? series->error.c_str() : "Invalid series";
+}
+
+int hdrmerge_set_camera_data(hdrmerge_series *series, const char *path) {
+    return guard(series, [&](ExposureSeries &es) {
+        es.cameraData = path ? path : "";
+    });
+}
+
+int hdrmerge_add_file(hdrmerge_series *series, const char *filename) {
+    return guard(series, [&](ExposureSeries &es) {
+        size_t count = es.size();
+        es.add(filename);
+        if (es.size() == count)
+            throw std::runtime_error("No input found for \"" + std::string(filename) + "\"!");
+    });
+}
+
+int hdrmerge_add_memory(hdrmerge_series *series, const char *name, const void *data, size_t size) {
+    return guard(series, [&](ExposureSeries &es) {
+        if (!data)
+            throw std::runtime_error("hdrmerge_add_memory(): invalid buffer!");
+        es.add(name ? name : "<memory>", (const uint8_t *) data, size);
+    });
+}
+
+size_t hdrmerge_exposure_count(const hdrmerge_series *series) {
+    return series ? series->es.size() : 0;
+}
+
+int hdrmerge_load(hdrmerge_series *series) {
+    return guard(series, [&](ExposureSeries &es) {
+        if (es.size() == 0)
+            throw std::runtime_error("The list of exposures to merge is empty!");
+        es.check();
+        es.load();
+    });
+}
+
+int hdrmerge_merge(hdrmerge_series *series, float saturation) {
+    return guard(series, [&](ExposureSeries &es) {
+        es.initTables(std::max(saturation, 0.0f));
+        es.merge();
+    });
+}
+
+int hdrmerge_demosaic(hdrmerge_series *series, const float *sensor2xyz) {
+    return guard(series, [&](ExposureSeries &es) {
+        if (!es.image_merged)
+            throw std::runtime_error("hdrmerge_demosaic(): no merged Bayer grid is available!");
+        float matrix[9];
+        sensorMatrix(sensor2xyz, matrix);
+        es.demosaic(matrix);
+    });
+}
+
+int hdrmerge_luminance(hdrmerge_series *series, const float *sensor2xyz) {
+    return guard(series, [&](ExposureSeries &es) {
+        if (!es.image_merged)
+            throw std::runtime_error("hdrmerge_luminance(): no merged Bayer grid is available!");
+        float matrix[9];
+        sensorMatrix(sensor2xyz, matrix);
+        es.luminance(matrix);
+    });
+}
+
+int hdrmerge_transform_color(hdrmerge_series *series, const float *sensor2xyz, int xyz) {
+    return guard(series, [&](ExposureSeries &es) {
+        if (!es.image_demosaiced)
+            throw std::runtime_error("hdrmerge_transform_color(): the image is not demosaiced!");
+        float matrix[9];
+        sensorMatrix(sensor2xyz, matrix);
+        es.transform_color(matrix, xyz != 0);
+    });
+}
+
+int hdrmerge_whitebalance(hdrmerge_series *series, const float *scale) {
+    return guard(series, [&](ExposureSeries &es) {
+        if (!es.image_demosaiced)
+            throw std::runtime_error("hdrmerge_whitebalance(): the image is not demosaiced!");
+        if (!scale)
+            throw std::runtime_error("hdrmerge_whitebalance(): invalid scale factors!");
+        float values[3] = { scale[0], scale[1], scale[2] };
+        es.whitebalance(values);
+    });
+}
+
+int hdrmerge_scale(hdrmerge_series *series, float factor) {
+    return guard(series, [&](ExposureSeries &es) {
+        es.scale(factor);
+    });
+}
+
+int hdrmerge_resample(hdrmerge_series *series, hdrmerge_filter filter, size_t width, size_t height) {
+    return guard(series, [&](ExposureSeries &es) {
+        if (!es.image_demosaiced && !es.image_luminance)
+            throw std::runtime_error("hdrmerge_resample(): only demosaiced or luminance images can be resampled!");
+        if (width == 0 || height == 0)
+            throw std::runtime_error("hdrmerge_resample(): invalid target resolution!");
+
+        std::unique_ptr<ReconstructionFilter> rfilter;
+        if (filter == HDRMERGE_FILTER_TENT)
+            rfilter.reset(new TentFilter());
+        else if (filter == HDRMERGE_FILTER_BOX)
+            rfilter.reset(new BoxFilter());
+        else
+            rfilter.reset(new LanczosSincFilter());
+
+        es.resample(*rfilter, width, height);
+    });
+}
+
+int hdrmerge_image_size(const hdrmerge_series *series, size_t *width, size_t *height, int *channels) {
+    return guard(series, [&](const ExposureSeries &es) {
+        ImageView view = es.image();
+        if (!view.data)
+            throw std::runtime_error("hdrmerge_image_size(): no image is available!");
+        if (width)
+            *width = view.width;
+        if (height)
+            *height = view.height;
+        if (channels)
+            *channels = view.channels;
+    });
+}
+
+int hdrmerge_copy_image(const hdrmerge_series *series, float *buffer, size_t row_stride) {
+    return guard(series, [&](const ExposureSeries &es) {
+        ImageView view = es.image();
+        if (!view.data)
+            throw std::runtime_error("hdrmerge_copy_image(): no image is available!");
+        if (!buffer)
+            throw std::runtime_error("hdrmerge_copy_image(): invalid buffer!");
+
+        size_t rowSize = view.width * view.channels;
+        if (row_stride == 0)
+            row_stride = rowSize;
+        else if (row_stride < rowSize)
+            throw std::runtime_error("hdrmerge_copy_image(): the row stride is too small!");
+
+        #pragma omp parallel for
+        for (int y=0; y<(int) view.height; ++y)
+            memcpy(buffer + y * row_stride, view.pixel(0, y), sizeof(float) * rowSize);
+    });
+}
+
+};
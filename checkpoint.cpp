@@ -0,0 +1,274 @@
+#include "hdrmerge.h"
+#include <string.h>
+#include <stdio.h>
+#include <limits>
+#include <boost/filesystem.hpp>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* Incremented whenever the layout of checkpoint files changes */
+#define CHECKPOINT_VERSION 1
+
+/* The pixel data starts at a multiple of this offset (a page on all common platforms) */
+#define CHECKPOINT_ALIGNMENT 4096
+
+/**
+ * Fixed-size part of the header of a checkpoint file. It is followed by a
+ * variable-size section that holds the metadata and exposure information,
+ * and, starting at 'dataOffset', the densely packed rows of the image
+ * (native byte order, interleaved channels, top row first)
+ */
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t stage;
+    uint32_t channels;
+    uint64_t width, height;
+    int32_t filter, blacklevel, whitepoint;
+    float saturation, isoSpeed, aperture;
+    uint64_t infoSize, dataOffset;
+};
+
+static const char checkpoint_magic[8] = { 'H', 'D', 'R', 'M', 'C', 'K', 'P', 'T' };
+
+/// Append a POD value to the variable-size section of the header
+template <typename T> static void appendValue(std::string &info, const T &value) {
+    info.append((const char *) &value, sizeof(T));
+}
+
+/// Append a length-prefixed string to the variable-size section of the header
+static void appendString(std::string &info, const std::string &value) {
+    appendValue(info, (uint32_t) value.length());
+    info.append(value);
+}
+
+/// Bounds-checked reader for the variable-size section of the header
+class InfoReader {
+public:
+    InfoReader(const std::string &info, const std::string &filename)
+        : m_info(info), m_filename(filename), m_pos(0) { }
+
+    template <typename T> T value() {
+        T result;
+        memcpy(&result, data(sizeof(T)), sizeof(T));
+        return result;
+    }
+
+    std::string string() {
+        uint32_t length = value<uint32_t>();
+        return std::string(data(length), length);
+    }
+
+private:
+    const char *data(size_t size) {
+        if (size > m_info.length() - m_pos)
+            throw std::runtime_error("Checkpoint file \"" + m_filename + "\" is corrupt!");
+        const char *result = m_info.data() + m_pos;
+        m_pos += size;
+        return result;
+    }
+
+    const std::string &m_info;
+    const std::string &m_filename;
+    size_t m_pos;
+};
+
+void ExposureSeries::writeCheckpoint(const std::string &filename, ECheckpointStage stage) const {
+    ImageView view;
+    if (stage == ECheckpointMerged && image_merged)
+        view = ImageView(image_merged, width, height, 1);
+    else if (stage == ECheckpointDemosaiced && image_demosaiced)
+        view = ImageView((float *) image_demosaiced, width, height, 3);
+    else
+        throw std::runtime_error("writeCheckpoint(): the requested image is not available!");
+
+    cout << "Writing checkpoint " << filename << " (" << width << "x" << height << ", "
+         << (stage == ECheckpointMerged ? "merged Bayer grid" : "demosaiced") << ") .." << endl;
+
+    std::string info;
+    appendValue(info, (uint32_t) metadata.size());
+    for (StringMap::const_iterator it = metadata.begin(); it != metadata.end(); ++it) {
+        appendString(info, it->first);
+        appendString(info, it->second);
+    }
+
+    appendValue(info, (uint32_t) exposures.size());
+    for (size_t i=0; i<exposures.size(); ++i) {
+        const Exposure &exp = exposures[i];
+        appendString(info, exp.filename);
+        appendString(info, exp.serial);
+        appendString(info, exp.lens);
+        appendValue(info, exp.exposure);
+        appendValue(info, exp.shown_exposure);
+        appendValue(info, exp.isoSpeed);
+        appendValue(info, exp.aperture);
+        appendValue(info, exp.focalLength);
+    }
+
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(CheckpointHeader));
+    memcpy(header.magic, checkpoint_magic, sizeof(checkpoint_magic));
+    header.version = CHECKPOINT_VERSION;
+    header.byteOrder = 0x01020304;
+    header.stage = (uint32_t) stage;
+    header.channels = (uint32_t) view.channels;
+    header.width = width;
+    header.height = height;
+    header.filter = filter;
+    header.blacklevel = blacklevel;
+    header.whitepoint = whitepoint;
+    header.saturation = saturation;
+    header.isoSpeed = isoSpeed;
+    header.aperture = aperture;
+    header.infoSize = info.length();
+    header.dataOffset = (sizeof(CheckpointHeader) + info.length() + CHECKPOINT_ALIGNMENT - 1)
+        / CHECKPOINT_ALIGNMENT * CHECKPOINT_ALIGNMENT;
+
+    std::string prefix((const char *) &header, sizeof(CheckpointHeader));
+    prefix += info;
+    prefix.resize((size_t) header.dataOffset, '\0');
+
+    writeFloatData(filename, prefix, view, false);
+}
+
+ECheckpointStage ExposureSeries::readCheckpoint(const std::string &filename) {
+    std::unique_ptr<FILE, int (*)(FILE *)> handle(fopen(filename.c_str(), "rb"), fclose);
+    FILE *file = handle.get();
+    if (!file)
+        throw std::runtime_error("Unable to open checkpoint file \"" + filename + "\"");
+
+    CheckpointHeader header;
+    std::string info;
+    bool success = fread(&header, sizeof(CheckpointHeader), 1, file) == 1;
+    if (success && memcmp(header.magic, checkpoint_magic, sizeof(checkpoint_magic)) != 0)
+        success = false;
+    if (success && header.infoSize < (1 << 30)) {
+        info.resize((size_t) header.infoSize);
+        success = info.empty() || fread(&info[0], 1, info.size(), file) == info.size();
+    }
+    if (!success)
+        throw std::runtime_error("\"" + filename + "\" is not a checkpoint file!");
+
+    if (header.version != CHECKPOINT_VERSION || header.byteOrder != 0x01020304)
+        throw std::runtime_error("Checkpoint file \"" + filename + "\" was written by an "
+            "incompatible version of hdrmerge or on a machine with a different byte order!");
+
+    if ((header.stage != ECheckpointMerged || header.channels != 1) &&
+        (header.stage != ECheckpointDemosaiced || header.channels != 3))
+        throw std::runtime_error("Checkpoint file \"" + filename + "\" is corrupt!");
+
+    /* Reject dimensions that are empty or whose sizes would overflow */
+    const uint64_t maxSize = std::numeric_limits<size_t>::max() / 2;
+    if (header.width == 0 || header.height == 0 || header.infoSize >= (1 << 30) ||
+        header.width > maxSize / header.height / header.channels / sizeof(float) ||
+        header.dataOffset < sizeof(CheckpointHeader) + header.infoSize ||
+        header.dataOffset > maxSize - header.width * header.height * header.channels * sizeof(float))
+        throw std::runtime_error("Checkpoint file \"" + filename + "\" is corrupt!");
+
+    ECheckpointStage stage = (ECheckpointStage) header.stage;
+    size_t count = (size_t) (header.width * header.height * header.channels),
+           size = (size_t) header.dataOffset + sizeof(float) * count;
+
+    if (boost::filesystem::file_size(filename) < size)
+        throw std::runtime_error("Checkpoint file \"" + filename + "\" is truncated!");
+
+    cout << "Resuming from checkpoint " << filename << " (" << header.width << "x" << header.height
+         << ", " << (stage == ECheckpointMerged ? "merged Bayer grid" : "demosaiced") << ") .." << endl;
+
+    /* Restore the metadata and exposure information */
+    InfoReader reader(info, filename);
+    metadata.clear();
+    uint32_t metadataCount = reader.value<uint32_t>();
+    for (uint32_t i=0; i<metadataCount; ++i) {
+        std::string key = reader.string();
+        metadata[key] = reader.string();
+    }
+
+    exposures.clear();
+    uint32_t exposureCount = reader.value<uint32_t>();
+    for (uint32_t i=0; i<exposureCount; ++i) {
+        exposures.push_back(Exposure(reader.string()));
+        Exposure &exp = exposures.back();
+        exp.serial = reader.string();
+        exp.lens = reader.string();
+        exp.exposure = reader.value<float>();
+        exp.shown_exposure = reader.value<float>();
+        exp.isoSpeed = reader.value<float>();
+        exp.aperture = reader.value<float>();
+        exp.focalLength = reader.value<float>();
+    }
+
+    width = (size_t) header.width;
+    height = (size_t) header.height;
+    filter = header.filter;
+    blacklevel = header.blacklevel;
+    whitepoint = header.whitepoint;
+    saturation = header.saturation;
+    isoSpeed = header.isoSpeed;
+    aperture = header.aperture;
+
+    float *data = stage == ECheckpointMerged ? new float[count]
+        : (float *) new float3[width * height];
+    success = false;
+
+#if !defined(_WIN32)
+    /* Copy the pixels out of a memory mapping in parallel (they can't be
+       used in place, since the later steps modify the image) */
+    struct stat st;
+    int fd = fileno(file);
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= size) {
+        void *ptr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr != MAP_FAILED) {
+            const float *src = (const float *) ((const uint8_t *) ptr + header.dataOffset);
+            size_t rowSize = width * header.channels;
+
+            #pragma omp parallel for
+            for (int y=0; y<(int) height; ++y)
+                memcpy(data + y * rowSize, src + y * rowSize, sizeof(float) * rowSize);
+
+            munmap(ptr, size);
+            success = true;
+        }
+    }
+#endif
+
+    if (!success) {
+        success = fseek(file, (long) header.dataOffset, SEEK_SET) == 0 &&
+                  fread(data, sizeof(float), count, file) == count;
+    }
+    handle.reset();
+
+    if (!success) {
+        if (stage == ECheckpointMerged)
+            delete[] data;
+        else
+            delete[] (float3 *) data;
+        throw std::runtime_error("Checkpoint file \"" + filename + "\" is truncated!");
+    }
+
+    if (image_merged) {
+        delete[] image_merged;
+        image_merged = NULL;
+    }
+    if (image_demosaiced) {
+        delete[] image_demosaiced;
+        image_demosaiced = NULL;
+    }
+    if (image_luminance) {
+        delete[] image_luminance;
+        image_luminance = NULL;
+    }
+
+    if (stage == ECheckpointMerged)
+        image_merged = data;
+    else
+        image_demosaiced = (float3 *) data;
+
+    return stage;
+}
@@ -19,80 +19,203 @@ template <typename Derived> void bernstein(const Eigen::MatrixBase<Derived> &_ve
 }
 
 /**
- * Simple data structure to keep track of fixed-size approximately
- * constant image patches that will be used to recover the camera
- * response function
+ * Summed-area tables of the values and squared values of an exposure, stored
+ * separately for each of the four planes of the 2x2 Bayer pattern. Together
+ * with tables of the minimum and maximum values in every (fixed-size) window,
+ * these provide the statistics of any patch in constant time.
+ *
+ * Sensors with other CFA layouts (and callers that only need a handful of
+ * queries) fall back to evaluating the pixels of each patch directly.
  */
-struct Patch {
-    static const size_t patch_size = 20;
-    size_t x, y;
+struct PatchStatistics {
+    /**
+     * Prepare the statistics of exposure 'img'. The patches that are queried
+     * later on must start at even pixel coordinates and have size 'patchSize'
+     */
+    PatchStatistics(const ExposureSeries &es, int img, size_t patchSize, bool tables = true)
+        : m_es(es), m_img(img), m_patchSize(patchSize), m_window(patchSize / 2),
+          m_width(es.width / 2), m_height(es.height / 2), m_direct(!tables) {
+        for (size_t y=0; y<8; ++y)
+            for (size_t x=0; x<2; ++x)
+                if (es.fc(x, y) != es.fc(x, y & 1))
+                    m_direct = true;
+        if (m_direct)
+            return;
+
+        size_t w = m_width, h = m_height, k = m_window;
+
+        for (int plane=0; plane<4; ++plane) {
+            size_t ox = plane & 1, oy = plane >> 1;
+            m_color[plane] = es.fc(ox, oy);
+
+            std::vector<double> &sum = m_sum[plane], &sumsq = m_sumsq[plane];
+            std::vector<float> &min = m_min[plane], &max = m_max[plane];
+            sum.resize((w+1) * (h+1));
+            sumsq.resize((w+1) * (h+1));
+            min.resize(w * h);
+            max.resize(w * h);
+
+            /* Per-row prefix sums and sliding window minima/maxima along X */
+            #pragma omp parallel for
+            for (int y=0; y<(int) h; ++y) {
+                std::vector<float> values(w);
+                for (size_t x=0; x<w; ++x)
+                    values[x] = es.eval(img, 2*x + ox, 2*y + oy);
+
+                double accum = 0, accumsq = 0;
+                size_t offset = (y+1) * (w+1);
+                sum[offset] = sumsq[offset] = 0;
+                for (size_t x=0; x<w; ++x) {
+                    accum += values[x];
+                    accumsq += values[x] * values[x];
+                    sum[offset + x + 1] = accum;
+                    sumsq[offset + x + 1] = accumsq;
+                }
 
-    /// Default dummy constructor
-    inline Patch() { }
+                for (size_t x=0; x+k<=w; ++x) {
+                    float vmin = values[x], vmax = values[x];
+                    for (size_t i=1; i<k; ++i) {
+                        vmin = std::min(vmin, values[x+i]);
+                        vmax = std::max(vmax, values[x+i]);
+                    }
+                    min[y*w + x] = vmin;
+                    max[y*w + x] = vmax;
+                }
+            }
+
+            /* Accumulate the prefix sums along Y */
+            for (size_t x=0; x<=w; ++x)
+                sum[x] = sumsq[x] = 0;
+            for (size_t y=1; y<=h; ++y) {
+                for (size_t x=0; x<=w; ++x) {
+                    sum[y*(w+1) + x] += sum[(y-1)*(w+1) + x];
+                    sumsq[y*(w+1) + x] += sumsq[(y-1)*(w+1) + x];
+                }
+            }
+
+            /* Sliding window minima/maxima along Y (in-place, top to bottom) */
+            #pragma omp parallel for
+            for (int x=0; x<(int) w; ++x) {
+                for (size_t y=0; y+k<=h; ++y) {
+                    float vmin = min[y*w + x], vmax = max[y*w + x];
+                    for (size_t i=1; i<k; ++i) {
+                        vmin = std::min(vmin, min[(y+i)*w + x]);
+                        vmax = std::max(vmax, max[(y+i)*w + x]);
+                    }
+                    min[y*w + x] = vmin;
+                    max[y*w + x] = vmax;
+                }
+            }
+        }
+    }
+
+    /// Compute per-channel statistics of the patch with upper left corner (x, y)
+    void query(size_t x, size_t y, float *min, float *max, float *mean, float *rel_stddev) const {
+        if (m_direct) {
+            queryDirect(x, y, min, max, mean, rel_stddev);
+            return;
+        }
+
+        double sum[3] = { 0, 0, 0 }, sumsq[3] = { 0, 0, 0 };
+        size_t count[3] = { 0, 0, 0 };
+        size_t w = m_width, k = m_window, px = x / 2, py = y / 2;
+
+        for (int i=0; i<3; ++i) {
+            min[i] =  std::numeric_limits<float>::infinity();
+            max[i] = -std::numeric_limits<float>::infinity();
+        }
+
+        for (int plane=0; plane<4; ++plane) {
+            int color = m_color[plane];
+            size_t i00 = py*(w+1) + px, i01 = i00 + k,
+                   i10 = i00 + k*(w+1), i11 = i10 + k;
+            const std::vector<double> &s = m_sum[plane], &s2 = m_sumsq[plane];
+
+            sum[color] += s[i11] - s[i10] - s[i01] + s[i00];
+            sumsq[color] += s2[i11] - s2[i10] - s2[i01] + s2[i00];
+            count[color] += k*k;
+            min[color] = std::min(min[color], m_min[plane][py*w + px]);
+            max[color] = std::max(max[color], m_max[plane][py*w + px]);
+        }
 
-    /// Randomly sample a patch position
-    inline Patch(const ExposureSeries &es) {
-        x = 2 * (size_t) (randf() * (es.width  - 4*patch_size)/2) + patch_size;
-        y = 2 * (size_t) (randf() * (es.height - 4*patch_size)/2) + patch_size;
+        for (int i=0; i<3; ++i) {
+            double m = sum[i] / count[i];
+            double variance = std::max(0.0, (sumsq[i] - sum[i] * m) / (count[i] - 1));
+            mean[i] = (float) m;
+            rel_stddev[i] = (float) (std::sqrt(variance) / std::abs(m));
+        }
     }
 
-    void computeStatistics(const ExposureSeries &es, int img, float *min, float *max, float *rel_stddev) const {
-        float mean[3], variance[3];
-        int count[3];
+private:
+    /// Evaluate the statistics of a patch pixel by pixel (works with any CFA layout)
+    void queryDirect(size_t x, size_t y, float *min, float *max, float *mean, float *rel_stddev) const {
+        double sum[3] = { 0, 0, 0 }, variance[3] = { 0, 0, 0 };
+        size_t count[3] = { 0, 0, 0 };
 
         for (int i=0; i<3; ++i) {
-            min[i]      =  std::numeric_limits<float>::infinity();
-            max[i]      = -std::numeric_limits<float>::infinity();
-            variance[i] = 0;
-            mean[i]     = 0;
-            count[i]    = 0;
+            min[i] =  std::numeric_limits<float>::infinity();
+            max[i] = -std::numeric_limits<float>::infinity();
         }
 
-        for (size_t yo=0; yo<patch_size; ++yo) {
-            for (size_t xo=0; xo<patch_size; ++xo) {
-                int color = es.fc(x+xo, y+yo);
-                float value = es.eval(img, x+xo, y+yo);
+        for (size_t yo=0; yo<m_patchSize; ++yo) {
+            for (size_t xo=0; xo<m_patchSize; ++xo) {
+                int color = m_es.fc(x+xo, y+yo);
+                float value = m_es.eval(m_img, x+xo, y+yo);
                 min[color] = std::min(min[color], value);
                 max[color] = std::max(max[color], value);
-                mean[color] += value;
+                sum[color] += value;
                 count[color]++;
             }
         }
 
         for (int i=0; i<3; ++i)
-            mean[i] /= count[i];
+            mean[i] = (float) (sum[i] / count[i]);
 
-        for (size_t yo=0; yo<patch_size; ++yo) {
-            for (size_t xo=0; xo<patch_size; ++xo) {
-                int color = es.fc(x+xo, y+yo);
-                float diff = es.eval(img, x+xo, y+yo)-mean[color];
+        for (size_t yo=0; yo<m_patchSize; ++yo) {
+            for (size_t xo=0; xo<m_patchSize; ++xo) {
+                int color = m_es.fc(x+xo, y+yo);
+                double diff = m_es.eval(m_img, x+xo, y+yo) - (double) mean[color];
                 variance[color] += diff*diff;
             }
         }
 
         for (int i=0; i<3; ++i)
-            rel_stddev[i] = std::sqrt(variance[i] / (count[i]-1)) / std::abs(mean[i]);
+            rel_stddev[i] = (float) (std::sqrt(variance[i] / (count[i]-1)) / std::abs(mean[i]));
     }
 
-    void computeMean(const ExposureSeries &es, int img, float *mean) const {
-        int count[3] = { 0, 0, 0 };
-        memset(mean, 0, sizeof(float)*3);
-        for (size_t yo=0; yo<patch_size; ++yo) {
-            for (size_t xo=0; xo<patch_size; ++xo) {
-                int color = es.fc(x+xo, y+yo);
-                mean[color] += es.eval(img, x+xo, y+yo);
-                count[color]++;
-            }
-        }
+    const ExposureSeries &m_es;
+    int m_img;
+    size_t m_patchSize, m_window, m_width, m_height;
+    bool m_direct;
+    int m_color[4];
+    std::vector<double> m_sum[4], m_sumsq[4];
+    std::vector<float> m_min[4], m_max[4];
+};
 
-        for (int i=0; i<3; ++i)
-            mean[i] /= count[i];
+/**
+ * Simple data structure to keep track of fixed-size approximately
+ * constant image patches that will be used to recover the camera
+ * response function
+ */
+struct Patch {
+    static const size_t patch_size = 20;
+    size_t x, y;
+
+    /// Default dummy constructor
+    inline Patch() { }
+
+    /// Randomly sample a patch position (deterministically, given the seed, exposure and sample index)
+    inline Patch(const ExposureSeries &es, uint64_t seed, size_t img, size_t index) {
+        x = 2 * (size_t) (randf(seed, img, 2*index)   * (es.width  - 4*patch_size)/2) + patch_size;
+        y = 2 * (size_t) (randf(seed, img, 2*index+1) * (es.height - 4*patch_size)/2) + patch_size;
     }
 
     /// Heuristic for deciding whether or not a patch is "good"
-    bool isGood(const ExposureSeries &es, int img, int ch) const {
-        float min[3], max[3], rel_stddev[3];
-        computeStatistics(es, img, min, max, rel_stddev);
+    bool isGood(const ExposureSeries &es, const PatchStatistics &stats, int ch, float *mean = NULL) const {
+        float min[3], max[3], mean_[3], rel_stddev[3];
+        stats.query(x, y, min, max, mean_, rel_stddev);
+        if (mean)
+            *mean = mean_[ch];
 
         return
             min[ch] > 0.01 &&
@@ -107,44 +230,106 @@ struct Patch {
     }
 };
 
-void ExposureSeries::fitExposureTimes() {
+/**
+ * Uniform grid with a cell size matching the patch size, which
+ * accelerates the overlap test: a patch can only overlap patches
+ * stored in the 3x3 neighborhood of its own cell
+ */
+struct PatchGrid {
+    PatchGrid(size_t width, size_t height)
+        : m_resX(width / Patch::patch_size + 1), m_resY(height / Patch::patch_size + 1),
+          m_cells(m_resX * m_resY) { }
+
+    /// Rebuild the grid from a list of patches
+    void build(const std::vector<Patch> &patches) {
+        for (size_t i=0; i<m_cells.size(); ++i)
+            m_cells[i].clear();
+        for (size_t i=0; i<patches.size(); ++i)
+            insert(patches[i]);
+    }
+
+    void insert(const Patch &p) {
+        m_cells[(p.y / Patch::patch_size) * m_resX + p.x / Patch::patch_size].push_back(p);
+    }
+
+    bool overlaps(const Patch &p) const {
+        size_t cx = p.x / Patch::patch_size, cy = p.y / Patch::patch_size;
+        for (size_t y=cy > 0 ? cy-1 : 0; y<=std::min(cy+1, m_resY-1); ++y) {
+            for (size_t x=cx > 0 ? cx-1 : 0; x<=std::min(cx+1, m_resX-1); ++x) {
+                const std::vector<Patch> &cell = m_cells[y*m_resX + x];
+                for (size_t i=0; i<cell.size(); ++i)
+                    if (p.overlaps(cell[i]))
+                        return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    size_t m_resX, m_resY;
+    std::vector<std::vector<Patch>> m_cells;
+};
+
+void ExposureSeries::fitExposureTimes(uint64_t seed) {
     const int patches_per_exposure = 200,
               max_tries            = patches_per_exposure * 100,
+              batch_size           = 1024,
               channel              = 1; // Use green channel for the estimation
 
     std::vector<Patch> patches, patchList;
+    std::vector<size_t> patchOrigin; /* Exposure in which each patch of 'patchList' was found */
     std::vector<bool> good(exposures.size());
     int good_exposures = 0;
 
-    cout << "Fitting exposure times .. " << endl;
+    /* Mean of every patch in every exposure (row-major by patch) */
+    std::vector<float> means;
+
+    PatchGrid grid(width, height);
+    std::vector<Patch> candidates(batch_size);
+    std::vector<char> candidateGood(batch_size);
+
+    cout << "Fitting exposure times (seed " << seed << ") .. " << endl;
     for (size_t img=0; img<exposures.size(); ++img) {
+        PatchStatistics stats(*this, img, Patch::patch_size);
+
         patches.erase(std::remove_if(patches.begin(), patches.end(),
-            [&](const Patch &p) { return !p.isGood(*this, img, channel); }), patches.end());
+            [&](const Patch &p) { return !p.isGood(*this, stats, channel); }), patches.end());
+        grid.build(patches);
 
+        /* Draw and evaluate candidates in parallel batches. They are then accepted
+           in order, which produces the same patches as a sequential search */
         int tries = 0;
-        for (tries=0; tries<max_tries; ++tries) {
-            if ((int) patches.size() == patches_per_exposure)
-                break;
-
-            Patch patch(*this);
+        while (tries < max_tries && (int) patches.size() < patches_per_exposure) {
+            int count = std::min(batch_size, max_tries - tries);
 
             /* Phase 1: is the sample good? */
-            if (!patch.isGood(*this, img, channel))
-                continue;
+            #pragma omp parallel for
+            for (int i=0; i<count; ++i) {
+                candidates[i] = Patch(*this, seed, img, tries + i);
+                candidateGood[i] = candidates[i].isGood(*this, stats, channel);
+            }
 
-            /* Phase 2: overlap test (could be accelerated, oh well..) */
-            bool valid = true;
-            for (size_t i=0; i<patches.size(); ++i) {
-                if (patch.overlaps(patches[i])) {
-                    valid = false;
-                    break;
-                }
+            /* Phase 2: overlap test */
+            for (int i=0; i<count && (int) patches.size() < patches_per_exposure; ++i, ++tries) {
+                if (!candidateGood[i] || grid.overlaps(candidates[i]))
+                    continue;
+
+                grid.insert(candidates[i]);
+                patches.push_back(candidates[i]);
+                patchList.push_back(candidates[i]);
+                patchOrigin.push_back(img);
             }
-            if (!valid)
-                continue;
+        }
 
-            patches.push_back(patch);
-            patchList.push_back(patch);
+        /* Evaluate the patches found so far in this exposure while its tables are
+           available (NaN marks patches that aren't good) */
+        means.resize(patchList.size() * exposures.size(), std::numeric_limits<float>::quiet_NaN());
+        #pragma omp parallel for
+        for (int i=0; i<(int) patchList.size(); ++i) {
+            float mean;
+            if (!patchList[i].isGood(*this, stats, channel, &mean))
+                mean = std::numeric_limits<float>::quiet_NaN();
+            means[i*exposures.size() + img] = mean;
         }
 
         good[img] = (patches.size() == (size_t) patches_per_exposure);
@@ -161,36 +346,26 @@ void ExposureSeries::fitExposureTimes() {
     if (good_exposures < 3)
         throw std::runtime_error("Less than 3 good exposures ..  this is not going to work!");
 
-    size_t nRows = 0;
-    for (size_t i=0; i<patchList.size(); ++i)
-        for (size_t img=0; img<exposures.size(); ++img)
-            if (good[img] && patchList[i].isGood(*this, img, channel))
-                ++nRows;
-
-    Eigen::MatrixXd A(nRows + 1, good_exposures + patchList.size());
-    Eigen::VectorXd b(nRows + 1);
-    A.setZero();
-    b.setZero();
+    /* Patches that were found in a later exposure are still missing from the earlier ones.
+       There are only a few of them, so evaluate their pixels directly instead of rebuilding
+       the tables */
+    for (size_t img=0; img<exposures.size(); ++img) {
+        PatchStatistics stats(*this, img, Patch::patch_size, false);
 
-    size_t row = 0;
-    for (size_t i=0; i<patchList.size(); ++i) {
-        int exposure_idx = 0;
-        for (size_t img=0; img<exposures.size(); ++img) {
-            if (!good[img])
+        #pragma omp parallel for schedule(dynamic, 16)
+        for (int i=0; i<(int) patchList.size(); ++i) {
+            if (patchOrigin[i] <= img)
                 continue;
-            if (patchList[i].isGood(*this, img, channel)) {
-                A(row, exposure_idx) = 1;
-                A(row, good_exposures + i) = 1;
-
-                float mean[3];
-                patchList[i].computeMean(*this, img, mean);
-                b(row) = std::log(mean[channel]) / std::log(2);
-                row++;
-            }
-            ++exposure_idx;
+            float mean;
+            if (!patchList[i].isGood(*this, stats, channel, &mean))
+                mean = std::numeric_limits<float>::quiet_NaN();
+            means[i*exposures.size() + img] = mean;
         }
     }
 
+    auto patchMean = [&](size_t i, size_t img) { return means[i*exposures.size() + img]; };
+    auto patchIsGood = [&](size_t i, size_t img) { return !std::isnan(patchMean(i, img)); };
+
     float longestExposure;
     for (size_t img=0; img<exposures.size(); ++img) {
         if (!good[img])
@@ -201,9 +376,68 @@ void ExposureSeries::fitExposureTimes() {
     cout << "  - Assuming that the " << longestExposure << "s exposure is accurate (and computing the" << endl
          << "    other exposure times with respect to it)" << endl;
 
-    A(nRows, good_exposures-1) = 1;
-    b(nRows) = std::log(longestExposure) / std::log(2);
-    Eigen::VectorXd result = A.colPivHouseholderQr().solve(b);
+    /* The fit is a linear least squares problem with one unknown per good exposure
+       (its log2 exposure time e_k) and per patch (its log2 radiance p_i), where each
+       observation of a patch in a good exposure contributes an equation e_k + p_i = b_ik.
+       The patch unknowns decouple: given the exposure times, each p_i is simply the
+       mean of b_ik - e_k over its observations. Eliminating them from the normal
+       equations leaves a tiny (good_exposures x good_exposures) system S e = r. */
+    Eigen::MatrixXd S = Eigen::MatrixXd::Zero(good_exposures, good_exposures);
+    Eigen::VectorXd r = Eigen::VectorXd::Zero(good_exposures);
+    std::vector<int> observed;
+    std::vector<double> values;
+
+    for (size_t i=0; i<patchList.size(); ++i) {
+        observed.clear();
+        values.clear();
+        int exposure_idx = 0;
+        for (size_t img=0; img<exposures.size(); ++img) {
+            if (!good[img])
+                continue;
+            if (patchIsGood(i, img)) {
+                observed.push_back(exposure_idx);
+                values.push_back(std::log(patchMean(i, img)) / std::log(2));
+            }
+            ++exposure_idx;
+        }
+
+        if (observed.empty())
+            continue;
+
+        double invCount = 1.0 / observed.size(), mean = 0;
+        for (size_t k=0; k<values.size(); ++k)
+            mean += values[k] * invCount;
+
+        for (size_t k=0; k<observed.size(); ++k) {
+            S(observed[k], observed[k]) += 1;
+            for (size_t l=0; l<observed.size(); ++l)
+                S(observed[k], observed[l]) -= invCount;
+            r(observed[k]) += values[k] - mean;
+        }
+    }
+
+    /* Fix the exposure time of the longest good exposure */
+    S(good_exposures-1, good_exposures-1) += 1;
+    r(good_exposures-1) += std::log(longestExposure) / std::log(2);
+    Eigen::VectorXd result = S.colPivHouseholderQr().solve(r);
+
+    /* Back-substitute to obtain the patch radiances */
+    std::vector<double> patchRadiance(patchList.size(), 0.0);
+    for (size_t i=0; i<patchList.size(); ++i) {
+        int exposure_idx = 0, count = 0;
+        double accum = 0;
+        for (size_t img=0; img<exposures.size(); ++img) {
+            if (!good[img])
+                continue;
+            if (patchIsGood(i, img)) {
+                accum += std::log(patchMean(i, img)) / std::log(2) - result[exposure_idx];
+                ++count;
+            }
+            ++exposure_idx;
+        }
+        if (count > 0)
+            patchRadiance[i] = accum / count;
+    }
 
     size_t index = 0;
     std::vector<float> exposuretimes_old(exposures.size());
@@ -235,16 +469,13 @@ void ExposureSeries::fitExposureTimes() {
 
         os << "datapoints=[";
         for (size_t patch_idx=0; patch_idx<patchList.size(); ++patch_idx) {
-            const Patch &patch = patchList[patch_idx];
             for (size_t img=0; img<exposures.size(); ++img) {
-                if (!patch.isGood(*this, img, channel))
+                if (!patchIsGood(patch_idx, img))
                     continue;
 
-                float mean[3];
-                patch.computeMean(*this, img, mean);
-                float x = mean[channel];
-                float y = std::pow(2.0f, result(good_exposures + patch_idx)) * exposures[img].exposure;
-                float z = std::pow(2.0f, result(good_exposures + patch_idx)) * exposuretimes_old[img];
+                float x = patchMean(patch_idx, img);
+                float y = std::pow(2.0, patchRadiance[patch_idx]) * exposures[img].exposure;
+                float z = std::pow(2.0, patchRadiance[patch_idx]) * exposuretimes_old[img];
                 os << x << ", " << y  << ", " << z << "; ";
             }
         }
@@ -33,13 +33,7 @@ void ExposureSeries::initTables(float saturation) {
 
     if (saturation == 0) {
         /* Determine the value of a pixel considered to be overexposured */
-        size_t npix = width*height;
-        uint16_t *temp = new uint16_t[npix];
-        memcpy(temp, exposures[size()-1].image, npix*sizeof(uint16_t));
-        size_t percentile = (size_t) (npix*0.999);
-        std::nth_element(temp, temp+percentile, temp+npix);
-        saturation = (*(temp+percentile)-blacklevel) / (float) (whitepoint-blacklevel);
-        delete[] temp;
+        saturation = (percentile(size()-1, 0.999f) - blacklevel) / (float) (whitepoint-blacklevel);
 
         cerr << endl
              << "*******************************************************************************" << endl
@@ -54,6 +48,7 @@ void ExposureSeries::initTables(float saturation) {
              << "lock this parameter by creating a line \"saturation=" << saturation << "\" in hdrmerge.cfg" << endl
              << "*******************************************************************************" << endl
              << endl;
+        this->saturation = saturation;
     }
 
     saturation = saturation * (whitepoint-blacklevel) + blacklevel;
@@ -63,6 +58,30 @@ void ExposureSeries::initTables(float saturation) {
         weight_tbl[i] = compute_weight((uint16_t) i, blacklevel, saturation);
 }
 
+uint16_t ExposureSeries::percentile(size_t img, float p, int color) const {
+    const std::vector<uint32_t> &histogram = exposures[img].histogram;
+    if (histogram.empty())
+        throw std::runtime_error("percentile(): the raw data has not been loaded!");
+
+    std::vector<size_t> bins(0x10000);
+    size_t total = 0;
+    for (int value=0; value<0x10000; ++value) {
+        for (int c=0; c<4; ++c)
+            if (color < 0 || c == color)
+                bins[value] += histogram[(c << 16) + value];
+        total += bins[value];
+    }
+
+    /* Same rank as std::nth_element at position p*total */
+    size_t rank = (size_t) (total * (double) p), accum = 0;
+    for (int value=0; value<0x10000; ++value) {
+        accum += bins[value];
+        if (accum > rank)
+            return (uint16_t) value;
+    }
+    return 0xFFFF;
+}
+
 void ExposureSeries::merge() {
     image_merged = new float[width * height];
 
@@ -70,12 +89,20 @@ void ExposureSeries::merge() {
     if (size() == 1) {
         cout << "Only one exposure was specified -- not doing HDR merging." << endl;
 
+        const float *dark = exposures[0].dark;
+
         #pragma omp parallel for
         for (int y=0; y<height; ++y) {
             uint16_t *src = exposures[0].image + y * width;
             float *dst = image_merged + y * width;
-            for (int x=0; x<width; ++x)
-                *dst++ = value_tbl[*src++];
+            if (dark) {
+                const float *darkPtr = dark + y * width;
+                for (size_t x=0; x<width; ++x)
+                    *dst++ = value_tbl[*src++] - *darkPtr++;
+            } else {
+                for (size_t x=0; x<width; ++x)
+                    *dst++ = value_tbl[*src++];
+            }
         }
         exposures[0].release();
         return;
@@ -94,7 +121,7 @@ void ExposureSeries::merge() {
             for (int img=0; img<size(); ++img) {
                 uint16_t pxvalue = exposures[img].image[offset];
                 float weight = weight_tbl[pxvalue];
-                value += value_tbl[pxvalue] * weight;
+                value += exposureValue(img, pxvalue, offset) * weight;
                 total_exposure += exposures[img].exposure * weight;
             }
             if (total_exposure > 0) {
@@ -103,7 +130,7 @@ void ExposureSeries::merge() {
                 /* No good exposures for this pixel! */
                 for (size_t img=0; img<size(); ++img) {
                     uint16_t pxvalue = exposures[img].image[offset];
-                    value += value_tbl[pxvalue];
+                    value += exposureValue(img, pxvalue, offset);
                     total_exposure += exposures[img].exposure;
                 }
             }
@@ -116,14 +143,18 @@ void ExposureSeries::merge() {
                using intensities predicted by the first estimate */
             float blacklevel = this->blacklevel, scale = this->whitepoint - blacklevel;
             for (size_t img=0; img<size(); ++img) {
+                /* The raw value also contains the dark signal that was subtracted in pass 1 */
+                const float *dark = exposures[img].dark;
                 float predicted = reference * exposures[img].exposure * scale + blacklevel;
+                if (dark)
+                    predicted += dark[offset] * scale;
                 uint16_t pxvalue = exposures[img].image[offset];
 
                 if (predicted <= 0 || predicted >= 65535.0f)
                     continue;
 
                 float weight = weight_tbl[(uint16_t) (predicted + 0.5f)];
-                value += value_tbl[pxvalue] * weight;
+                value += exposureValue(img, pxvalue, offset) * weight;
                 total_exposure += exposures[img].exposure * weight;
             }
 
@@ -365,11 +396,59 @@ void ExposureSeries::demosaic(float *sensor2xyz) {
     }
 
     delete[] buffers;
-    delete[] image_merged;
-    image_merged = NULL;
+    if (!keepMerged) {
+        delete[] image_merged;
+        image_merged = NULL;
+    }
+}
+
+void ExposureSeries::luminance(float *sensor2xyz) {
+    cout << "Computing luminance from the Bayer grid .." << endl;
+
+    /* Second row of the sensor to XYZ matrix */
+    const float weights[3] = { sensor2xyz[3], sensor2xyz[4], sensor2xyz[5] };
+
+    image_luminance = new float[width*height];
+
+    /* Bilinear interpolation: average the samples of each color in a 3x3
+       neighborhood and directly combine them into a luminance value */
+    #pragma omp parallel for
+    for (int y=0; y<(int) height; ++y) {
+        float *dst = image_luminance + y*width;
+        for (size_t x=0; x<width; ++x) {
+            float binval[3] = {0, 0, 0};
+            int bincount[3] = {0, 0, 0};
+
+            for (size_t ys=y-1; ys != (size_t) y+2; ++ys) {
+                for (size_t xs=x-1; xs != x+2; ++xs) {
+                    if (ys < height && xs < width) {
+                        int col = fc(xs, ys);
+                        binval[col] += image_merged[ys*width+xs];
+                        ++bincount[col];
+                    }
+                }
+            }
+
+            int col = fc(x, y);
+            binval[col] = image_merged[y*width+x];
+            bincount[col] = 1;
+
+            float value = 0;
+            for (int c=0; c<3; ++c) {
+                if (bincount[c])
+                    value += weights[c] * binval[c] / bincount[c];
+            }
+            *dst++ = value;
+        }
+    }
+
+    if (!keepMerged) {
+        delete[] image_merged;
+        image_merged = NULL;
+    }
 }
 
-void ExposureSeries::transform_color(float *sensor2xyz, bool xyz) {
+void ExposureSeries::transform_color(float *sensor2xyz, bool xyz, const GainMap *gainmap) {
     const float xyz2rgb[3][3] = {
         { 3.240479f, -1.537150f, -0.498535f },
         {-0.969256f, +1.875991f, +0.041556f },
@@ -378,10 +457,13 @@ void ExposureSeries::transform_color(float *sensor2xyz, bool xyz) {
     float M[3][3];
 
     if (xyz) {
-        cout << "Transforming to XYZ color space .." << endl;
+        cout << "Transforming to XYZ color space";
     } else {
-        cout << "Transforming to sRGB color space .." << endl;
+        cout << "Transforming to sRGB color space";
     }
+    if (gainmap)
+        cout << " and correcting for vignetting";
+    cout << " .." << endl;
 
     for (int i=0; i<3; ++i) {
         for (int j=0; j<3; ++j) {
@@ -399,13 +481,20 @@ void ExposureSeries::transform_color(float *sensor2xyz, bool xyz) {
     #pragma omp parallel for
     for (int y=0; y<height; ++y) {
         float3 *ptr = image_demosaiced + y*width;
+        std::vector<float> gains;
+        if (gainmap) {
+            gains.resize(gainmap->resX);
+            gainmap->row(y, &gains[0]);
+        }
+
         for (size_t x=0; x<width; ++x) {
             float accum[3] = {0, 0, 0};
             for (int i=0; i<3; ++i)
                 for (int j=0; j<3; ++j)
                     accum[i] += M[i][j] * ptr[0][j];
+            float gain = gainmap ? gainmap->eval(&gains[0], x) : 1.0f;
             for (int i=0; i<3; ++i)
-                ptr[0][i] = accum[i];
+                ptr[0][i] = accum[i] * gain;
             ++ptr;
         }
     }
@@ -434,6 +523,24 @@ void ExposureSeries::scale(float factor) {
             }
         }
     }
+
+    if (image_luminance) {
+        #pragma omp parallel for
+        for (int y=0; y<(int) height; ++y) {
+            float *ptr = image_luminance + y*width;
+            for (size_t x=0; x<width; ++x)
+                *ptr++ *= factor;
+        }
+    }
+}
+
+ImageView ExposureSeries::image() const {
+    if (image_demosaiced)
+        return ImageView((float *) image_demosaiced, width, height, 3);
+    else if (image_luminance)
+        return ImageView(image_luminance, width, height, 1);
+    else
+        return ImageView(image_merged, width, height, 1);
 }
 
 void ExposureSeries::crop(int offs_x, int offs_y, int w, int h) {
@@ -473,6 +580,20 @@ void ExposureSeries::crop(int offs_x, int offs_y, int w, int h) {
         image_demosaiced = temp;
     }
 
+    if (image_luminance) {
+        float *temp = new float[w*h];
+
+        for (int y=0; y<h; ++y) {
+            float *dst = temp + w * y;
+            float *src = image_luminance + width * (y+offs_y) + offs_x;
+
+            for (int x=0; x<w; ++x)
+                *dst++ = *src++;
+        }
+        delete[] image_luminance;
+        image_luminance = temp;
+    }
+
     width = w;
     height = h;
 }
@@ -514,67 +635,104 @@ void ExposureSeries::whitebalance(float *scale) {
     }
 }
 
-void ExposureSeries::vcal() {
+void ExposureSeries::vcal(float *coeffs) {
     /* Simplistic vignetting correction -- assumes that vignetting is radially symmetric
        around the image center and least-squares-fits a 6-th order polynomial. Probably
        good enough for most purposes though.. */
     double center_x = width / 2.0, center_y = height / 2.0;
-    size_t skip = 10, nPixels = ((width+skip-1)/skip) * ((height+skip-1)/skip);
     double size_scale = 1.0 / std::max(width, height);
 
-    Eigen::MatrixXd A(nPixels, 4);
-    Eigen::VectorXd b(nPixels);
-
     cout << "Fitting a 6-th order polynomial to the vignetting profile .." << endl;
-    size_t idx = 0;
 
-    for (size_t y=0; y<height; y += skip) {
-        float3 *ptr = image_demosaiced + y*width;
+    /* Rather than building the (huge) least squares system, directly accumulate the
+       4x4 normal equations A^T A x = A^T b. Since the rows of A are [1, r^2, r^4, r^6],
+       A^T A only involves the power sums of r^2 up to r^12, and A^T b those of
+       luminance * r^2 up to r^6. These are summed per row and per thread. */
+    struct Moments {
+        double ata[7], atb[4];
+    };
+
+    std::vector<Moments> moments(omp_get_max_threads());
+    memset(&moments[0], 0, sizeof(Moments) * moments.size());
+
+    #pragma omp parallel for
+    for (int y=0; y<(int) height; ++y) {
         double dy = ((y + 0.5f) - center_y)*size_scale, dy2 = dy*dy;
-        for (size_t x=0; x<width; x += skip) {
-            double luminance = ptr[0][0] * 0.212671 + ptr[0][1] * 0.715160 + ptr[0][2] * 0.072169;
+        Moments row;
+        memset(&row, 0, sizeof(Moments));
+
+        for (size_t x=0; x<width; ++x) {
+            double luminance;
+            if (image_demosaiced) {
+                float3 &pixel = image_demosaiced[y*width + x];
+                luminance = pixel[0] * 0.212671 + pixel[1] * 0.715160 + pixel[2] * 0.072169;
+            } else {
+                luminance = image_luminance[y*width + x];
+            }
             double dx = ((x + 0.5f) - center_x) * size_scale, dx2 = dx*dx;
-            double dist2 = dx2+dy2, dist4 = dist2*dist2, dist6 = dist4*dist2;
-            A(idx, 0) = 1.0f;
-            A(idx, 1) = dist2;
-            A(idx, 2) = dist4;
-            A(idx, 3) = dist6;
-            b(idx) = luminance;
-            ptr += skip;
-            idx++;
+            double dist2 = dx2+dy2, power = 1;
+
+            for (int i=0; i<7; ++i) {
+                row.ata[i] += power;
+                if (i < 4)
+                    row.atb[i] += power * luminance;
+                power *= dist2;
+            }
         }
+
+        Moments &accum = moments[omp_get_thread_num()];
+        for (int i=0; i<7; ++i)
+            accum.ata[i] += row.ata[i];
+        for (int i=0; i<4; ++i)
+            accum.atb[i] += row.atb[i];
     }
-    if (nPixels != idx) {
-        cout << idx << " vs " << nPixels << endl;
-        exit(-1);
+
+    Eigen::Matrix4d AtA = Eigen::Matrix4d::Zero();
+    Eigen::Vector4d Atb = Eigen::Vector4d::Zero();
+    for (size_t t=0; t<moments.size(); ++t) {
+        for (int i=0; i<4; ++i) {
+            for (int j=0; j<4; ++j)
+                AtA(i, j) += moments[t].ata[i+j];
+            Atb(i) += moments[t].atb[i];
+        }
     }
 
-    Eigen::VectorXd result = A.colPivHouseholderQr().solve(b);
+    Eigen::Vector4d result = AtA.colPivHouseholderQr().solve(Atb);
     result /= result(0);
 
     cout << "Done. Pass --vcorr \"" << result[1] << ", " << result[2] << ", " << result[3]
          << "\" to hdrmerge in future runs (or add to 'hdrmerge.cfg')" << endl;
 
-    vcorr((float) result[1], (float) result[2], (float) result[3]);
+    for (int i=0; i<3; ++i)
+        coeffs[i] = (float) result[i+1];
+
+    vcorr(coeffs[0], coeffs[1], coeffs[2]);
 }
 
 void ExposureSeries::vcorr(float a, float b, float c) {
-    double center_x = width / 2.0, center_y = height / 2.0;
-    double size_scale = 1.0 / std::max(width, height);
+    vcorr(GainMap(width, height, a, b, c));
+}
 
+void ExposureSeries::vcorr(const GainMap &gainmap) {
     cout << "Correcting for vignetting .." << endl;
 
     #pragma omp parallel for
     for (int y=0; y<height; ++y) {
-        float3 *ptr = image_demosaiced + y*width;
-        double dy = ((y + 0.5f) - center_y)*size_scale, dy2 = dy*dy;
-        for (int x=0; x<width; ++x) {
-            double dx = ((x + 0.5f) - center_x)*size_scale, dx2 = dx*dx;
-            double dist2 = dx2+dy2, dist4 = dist2*dist2, dist6 = dist4*dist2;
-            float corr = 1.0f / (1.0f + dist2*a + dist4*b + dist6*c);
-            for (int c=0; c<3; ++c)
-                ptr[0][c] *= corr;
-            ++ptr;
+        std::vector<float> gains(gainmap.resX);
+        gainmap.row(y, &gains[0]);
+
+        if (image_demosaiced) {
+            float3 *ptr = image_demosaiced + y*width;
+            for (size_t x=0; x<width; ++x) {
+                float gain = gainmap.eval(&gains[0], x);
+                for (int c=0; c<3; ++c)
+                    ptr[0][c] *= gain;
+                ++ptr;
+            }
+        } else {
+            float *ptr = image_luminance + y*width;
+            for (size_t x=0; x<width; ++x)
+                *ptr++ *= gainmap.eval(&gains[0], x);
         }
     }
 }
@@ -11,6 +11,7 @@
 #include <iostream>
 #include <stdint.h>
 #include <memory>
+#include <cstddef>
 
 using std::cout;
 using std::cerr;
@@ -25,19 +26,64 @@ typedef float float3[3];
 /// Abstract reconstruction filter
 class ReconstructionFilter {
 public:
+    virtual ~ReconstructionFilter() { }
     virtual float getRadius() const = 0;
     virtual float eval(float x) const = 0;
 };
 
+/**
+ * Low-resolution map of the vignetting correction factors 1/(1+ax^2+bx^4+cx^6),
+ * which is bilinearly interpolated to the full image resolution. The
+ * interpolation is separable: \ref row() blends two rows of the map, after
+ * which each pixel only requires a single linear interpolation.
+ */
+struct GainMap {
+    /// Tabulate the correction for an image of the given size
+    GainMap(size_t width, size_t height, float a, float b, float c);
+
+    /// Interpolate the map along Y (requires a buffer with \ref resX entries)
+    void row(size_t y, float *buffer) const;
+
+    /// Evaluate the gain of pixel 'x' given the output of \ref row()
+    inline float eval(const float *row, size_t x) const {
+        uint32_t i = xIndex[x];
+        float t = xWeight[x];
+        return row[i] * (1-t) + row[i+1] * t;
+    }
+
+    /* Resolution of the map */
+    size_t resX, resY;
+
+    /* Tabulated gain factors */
+    std::vector<float> data;
+
+    /* Precomputed interpolation indices and weights */
+    std::vector<uint32_t> xIndex, yIndex;
+    std::vector<float> xWeight, yWeight;
+};
+
 /// Records a single RAW exposure
 struct Exposure {
     std::string filename;
     float exposure;
     float shown_exposure;
+    float isoSpeed, aperture, focalLength;
+    std::string serial, lens;
     uint16_t *image;
 
+    /* Master dark frame that is subtracted during merging (not owned, may be NULL) */
+    const float *dark;
+
+    /* Histograms of the raw sensor values (one 16-bit histogram per CFA color), built by load() */
+    std::vector<uint32_t> histogram;
+
+    /* Contents of the RAW file when it was provided in memory rather than on disk, followed
+       by FILEMAP_MARGIN bytes of padding for RawSpeed (may be NULL, and is released by load()) */
+    std::shared_ptr<std::vector<uint8_t>> buffer;
+
     inline Exposure(const std::string &filename)
-     : filename(filename), exposure(-1), image(NULL) { }
+     : filename(filename), exposure(-1), isoSpeed(-1), aperture(-1),
+       focalLength(-1), image(NULL), dark(NULL) { }
 
     inline ~Exposure() {
         release();
@@ -61,6 +107,89 @@ struct Exposure {
     }
 };
 
+enum ERotateFlipType {
+    ERotateNoneFlipNone = 0,
+    ERotate180FlipXY    = ERotateNoneFlipNone,
+    ERotate90FlipNone   = 1,
+    ERotate270FlipXY    = ERotate90FlipNone,
+    ERotate180FlipNone  = 2,
+    ERotateNoneFlipXY   = ERotate180FlipNone,
+    ERotate270FlipNone  = 3,
+    ERotate90FlipXY     = ERotate270FlipNone,
+    ERotateNoneFlipX    = 4,
+    ERotate180FlipY     = ERotateNoneFlipX,
+    ERotate90FlipX      = 5,
+    ERotate270FlipY     = ERotate90FlipX,
+    ERotate180FlipX     = 6,
+    ERotateNoneFlipY    = ERotate180FlipX,
+    ERotate270FlipX     = 7,
+    ERotate90FlipY      = ERotate270FlipX
+};
+
+/**
+ * Non-owning view of an image stored in a buffer of floats. The strides
+ * are specified in floats and may be negative, hence crops and flips
+ * only need to adjust the view (and can be consumed by the output code
+ * without copying the pixels).
+ */
+struct ImageView {
+    /* Address of the first channel of pixel (0, 0) */
+    float *data;
+    size_t width, height;
+    int channels;
+    ptrdiff_t xStride, yStride;
+
+    inline ImageView() : data(NULL), width(0), height(0), channels(0), xStride(0), yStride(0) { }
+
+    /// Create a view of a densely packed image
+    inline ImageView(float *data, size_t width, size_t height, int channels)
+     : data(data), width(width), height(height), channels(channels),
+       xStride(channels), yStride((ptrdiff_t) width * channels) { }
+
+    /// Return a pointer to the channels of pixel (x, y)
+    inline float *pixel(size_t x, size_t y) const {
+        return data + (ptrdiff_t) x * xStride + (ptrdiff_t) y * yStride;
+    }
+
+    /// Return a view of the rectangle (x, y, w, h)
+    inline ImageView crop(int x, int y, int w, int h) const {
+        if (x < 0 || y < 0 || w <= 0 || h <= 0 || x+w > (int) width || y+h > (int) height)
+            throw std::runtime_error("crop(): selected an invalid rectangle!");
+        ImageView result(*this);
+        result.data = pixel(x, y);
+        result.width = w;
+        result.height = h;
+        return result;
+    }
+
+    /// Return a flipped view (only supports transformations that don't rotate by 90 or 270 degrees)
+    inline ImageView flip(ERotateFlipType type) const {
+        if (type & 1)
+            throw std::runtime_error("flip(): rotations by 90 or 270 degrees require a copy!");
+        bool flip_x = (type & 6) == 2 || (type & 6) == 4;
+        bool flip_y = (type & 3) == 1 || (type & 3) == 2;
+
+        ImageView result(*this);
+        if (flip_x) {
+            result.data += (ptrdiff_t) (width - 1) * xStride;
+            result.xStride = -xStride;
+        }
+        if (flip_y) {
+            result.data += (ptrdiff_t) (height - 1) * yStride;
+            result.yStride = -yStride;
+        }
+        return result;
+    }
+};
+
+/// Processing stages whose results can be stored in a checkpoint file
+enum ECheckpointStage {
+    ECheckpointMerged = 0,
+    ECheckpointDemosaiced
+};
+
+extern std::istream& operator>>(std::istream& in, ECheckpointStage& unit);
+
 /// Stores a series of exposures, manages demosaicing and subsequent steps
 struct ExposureSeries {
     std::vector<Exposure> exposures;
@@ -72,12 +201,18 @@ struct ExposureSeries {
     /* Black level and whitepoint as determined by RawSpeed */
     int blacklevel, whitepoint;
 
+    /* ISO speed and aperture shared by all exposures */
+    float isoSpeed, aperture;
+
     /* Merged high dynamic range image (no demosaicing yet) */
     float *image_merged;
 
     /* Merged and demosaiced image */
     float3 *image_demosaiced;
 
+    /* Luminance image (only used when writing grayscale output) */
+    float *image_luminance;
+
     /* dcraw-style color filter array description */
     int filter;
 
@@ -87,14 +222,27 @@ struct ExposureSeries {
     /* Tables for transforming from sensor values to exposures / weights */
     float weight_tbl[0xFFFF], value_tbl[0xFFFF];
 
+    /* Master dark frames referenced by the exposures (normalized like value_tbl) */
+    std::vector<float *> darkframes;
+
+    /* Keep 'image_merged' after demosaicing (e.g. to also write the raw Bayer grid) */
+    bool keepMerged;
+
+    /* Path of RawSpeed's camera database (empty: search next to the executable) */
+    std::string cameraData;
+
     inline ExposureSeries() : 
-        image_merged(NULL), image_demosaiced(NULL) { }
+        image_merged(NULL), image_demosaiced(NULL), image_luminance(NULL), keepMerged(false) { }
 
     ~ExposureSeries() {
         if (image_merged)
             delete[] image_merged;
         if (image_demosaiced)
             delete[] image_demosaiced;
+        if (image_luminance)
+            delete[] image_luminance;
+        for (size_t i=0; i<darkframes.size(); ++i)
+            delete[] darkframes[i];
     }
 
     /// Return the color at position (x, y)
@@ -104,10 +252,27 @@ struct ExposureSeries {
 
     /**
      * Add a file to the exposure series (or, optionally, a sequence
-     * such as file_%03i.png expressed using the printf-style format)
+     * such as file_%03i.png expressed using the printf-style format).
+     * The name "-" reads the files from standard input (see \ref addStdin())
      */
     void add(const std::string &filename);
 
+    /**
+     * Add a RAW file that is already in memory. 'name' is only used in
+     * messages. This takes ownership of the contents of 'data'
+     */
+    void add(const std::string &name, std::vector<uint8_t> &&data);
+
+    /// Add a copy of a RAW file that is already in memory
+    void add(const std::string &name, const uint8_t *data, size_t size);
+
+    /**
+     * Add all RAW files from standard input, which either contains a tar
+     * archive or a sequence of frames that each consist of a 64-bit little
+     * endian length followed by the file contents
+     */
+    void addStdin();
+
     /**
      * Check that all exposures are valid, and that they satisfy
      * a few basic requirements such as:
@@ -119,27 +284,82 @@ struct ExposureSeries {
      */
     void check();
 
+    /**
+     * Only read the exposure settings, camera serial number and lens
+     * information of every exposure (without the checks done by \ref check())
+     */
+    void readExposureInfo();
+
     /**
      * Run dcraw on an entire exposure series (in parallel)
      * and fill the exposure series with a normalized RGB floating
-     * point image representation
+     * point image representation. RAW files that were added from memory
+     * are released once all exposures have been decoded
      */
     void load();
 
+    /**
+     * Average a series of dark frames (or, optionally, a sequence expressed
+     * using a printf-style format) into per-pixel master darks, one for each
+     * exposure time. These are subtracted during the merging step.
+     *
+     * Master darks are cached in the directory 'cacheDir' (keyed by camera
+     * serial number, ISO speed and exposure time), so that they can be
+     * reused by subsequent runs. Must be called after \ref load().
+     */
+    void loadDarkFrames(const std::string &fmt, const std::string &cacheDir);
+
+    /**
+     * Return the dark frames matching 'fmt' along with the cached master
+     * darks that \ref loadDarkFrames() would use instead of them. Only
+     * reads the EXIF tags of the dark frames (for the result cache)
+     */
+    std::vector<std::string> darkFrameFiles(const std::string &fmt, const std::string &cacheDir) const;
+
     /// Initialize the exposure / weight table
     void initTables(float saturation);
 
+    /**
+     * Return the raw value below which a fraction 'p' of the pixels of exposure
+     * 'img' lie. When 'color' is negative, all CFA colors are considered
+     */
+    uint16_t percentile(size_t img, float p, int color = -1) const;
+
+    /// Write per-exposure and per-channel statistics of the raw data to a JSON file
+    void writeStatistics(const std::string &filename) const;
+
     /// Merge all exposures into a single HDR image and release the RAW data
     void merge();
 
-    /// Estimate the exposure times in case the EXIF tags can't be trusted
-    void fitExposureTimes();
+    /**
+     * Estimate the exposure times in case the EXIF tags can't be trusted.
+     * The patch sampling only depends on 'seed', hence the result is
+     * reproducible regardless of the number of threads
+     */
+    void fitExposureTimes(uint64_t seed = 0);
 
     /// Perform demosaicing
     void demosaic(float *sensor2xyz);
 
-    /// Transform the image into the right color space
-    void transform_color(float *sensor2xyz, bool xyz);
+    /**
+     * Downsample each color plane of the merged Bayer grid to the resolution
+     * w x h and combine them into an RGB image. This replaces demosaicing at
+     * full resolution when the output is much smaller than the sensor.
+     */
+    void demosaicDownsampled(const ReconstructionFilter &filter, size_t w, size_t h);
+
+    /**
+     * Compute a luminance (Y) image directly from the merged Bayer grid
+     * using a cheap bilinear demosaic (replaces the full AHD step when
+     * only grayscale output is desired)
+     */
+    void luminance(float *sensor2xyz);
+
+    /**
+     * Transform the image into the right color space. Optionally, a vignetting
+     * correction is applied in the same pass.
+     */
+    void transform_color(float *sensor2xyz, bool xyz, const GainMap *gainmap = NULL);
 
     /// Scale the image brightness by a given factor
     void scale(float factor);
@@ -150,26 +370,84 @@ struct ExposureSeries {
     /// Crop a rectangular region
     void crop(int x, int y, int w, int h);
 
+    /**
+     * Return a view of the current image (the demosaiced or luminance
+     * image, or the raw Bayer grid if neither is available)
+     */
+    ImageView image() const;
+
+    /**
+     * Crop the region (x, y, w, h), resample it to the resolution
+     * width_t x height_t and rotate/flip the result in a single pass
+     */
+    void warp(const ReconstructionFilter &filter, int x, int y, int w, int h,
+        size_t width_t, size_t height_t, ERotateFlipType type);
+
     /// Apply white balancing
     void whitebalance(float *scale);
 
     /// Apply white balancing based on a grey patch
     void whitebalance(int xoffs, int yoffs, int w, int h);
 
-    /// Remove vignetting / calibration routine
-    void vcal();
+    /// Remove vignetting / calibration routine (returns the coefficients in 'result')
+    void vcal(float *result);
 
     /// Correct for vignetting using a radial polynomial 1+ax^2+bx^4+cx^6
     void vcorr(float a, float b, float c);
 
+    /// Correct for vignetting using a precomputed gain map
+    void vcorr(const GainMap &gainmap);
+
+    /**
+     * Look up a cached vignetting correction for the camera, lens, focal
+     * length and aperture used to take the exposure series
+     */
+    bool loadFlatField(const std::string &cacheDir, float *coeffs) const;
+
+    /// Store a vignetting correction in the flat-field cache
+    void saveFlatField(const std::string &cacheDir, const float *coeffs) const;
+
+    /**
+     * Return the flat-field cache entry of the exposure series (or an empty
+     * string if the EXIF data doesn't identify the lens). Must be called
+     * after \ref check()
+     */
+    std::string flatFieldFile(const std::string &cacheDir) const;
+
+    /**
+     * Write the merged Bayer grid or the demosaiced image to a checkpoint
+     * file, along with everything that later steps need (color filter
+     * pattern, metadata and exposure information). The pixels are stored
+     * uncompressed at a page-aligned offset, so that the file can be mapped
+     * into memory directly.
+     */
+    void writeCheckpoint(const std::string &filename, ECheckpointStage stage) const;
+
+    /**
+     * Restore the state written by \ref writeCheckpoint(), which replaces
+     * steps 1-2 (and 3, for demosaiced checkpoints). The exposures only
+     * hold their EXIF information afterwards. Returns the stored stage
+     */
+    ECheckpointStage readCheckpoint(const std::string &filename);
+
     /// Return the number of exposures
     inline size_t size() const {
         return exposures.size();
     }
 
+    /// Convert a raw sensor value into a relative exposure (subtracting the dark signal, if available)
+    inline float exposureValue(int img, uint16_t pxvalue, size_t offset) const {
+        const float *dark = exposures[img].dark;
+        float value = value_tbl[pxvalue];
+        if (dark)
+            value -= dark[offset];
+        return value;
+    }
+
     /// Evaluate a pixel in one of the images
     float eval(int img, int x, int y) const {
-        return value_tbl[exposures[img].image[x + y*width]];
+        size_t offset = x + y*width;
+        return exposureValue(img, exposures[img].image[offset], offset);
     }
 };
 
@@ -197,29 +475,164 @@ private:
     float m_radius;
 };
 
+/// Box filter
+class BoxFilter : public ReconstructionFilter {
+public:
+    BoxFilter(float radius = 0.5f) : m_radius(radius) { }
+
+    float getRadius() const { return m_radius; }
+
+    float eval(float x) const;
+private:
+    float m_radius;
+};
+
 
 
 /// Return the number of processors available for multithreading
 extern int getProcessorCount();
 
+/// Compression schemes of OpenEXR files
+enum EEXRCompression {
+    EEXRNone,
+    EEXRRLE,
+    EEXRZIPS,
+    EEXRZIP,
+    EEXRPIZ,
+    EEXRPXR24,
+    EEXRB44,
+    EEXRDWAA,
+    EEXRDWAB
+};
+
+/// Resolution levels stored in tiled OpenEXR files
+enum EEXRLevels {
+    EEXROneLevel,
+    EEXRMipmap,
+    EEXRRipmap
+};
+
+/// Order of the scanlines / tiles in OpenEXR files
+enum EEXRLineOrder {
+    EEXRIncreasingY,
+    EEXRDecreasingY,
+    EEXRRandomY
+};
+
+extern std::istream& operator>>(std::istream& in, EEXRCompression& unit);
+extern std::istream& operator>>(std::istream& in, EEXRLevels& unit);
+extern std::istream& operator>>(std::istream& in, EEXRLineOrder& unit);
+
+/// Options that control the layout and compression of OpenEXR files
+struct EXROptions {
+    EEXRCompression compression;
+    EEXRLevels levels;
+    EEXRLineOrder lineOrder;
+
+    /* Tile size (zero: write a scanline-based file) */
+    size_t tileWidth, tileHeight;
+
+    /* Report the throughput and compression ratio of each write */
+    bool profile;
+
+    inline EXROptions() : compression(EEXRZIP), levels(EEXROneLevel),
+        lineOrder(EEXRIncreasingY), tileWidth(0), tileHeight(0), profile(false) { }
+};
+
 /**
  * Write a lossless floating point OpenEXR file using either half or
  * single precision (grayscale or RGB)
  */
-extern void writeOpenEXR(const std::string &filename, size_t w, size_t h,
-    int channels, float *data, const StringMap &metadata, bool writeHalf);
+extern void writeOpenEXR(const std::string &filename, const ImageView &image,
+    const StringMap &metadata, bool writeHalf, const EXROptions &options = EXROptions());
+
+/**
+ * Resample an image to the resolution width_t x height_t. Returns a newly
+ * allocated and densely packed buffer (the source image is left untouched)
+ */
+extern float *resampleImage(const ReconstructionFilter &filter, const ImageView &image,
+    size_t width_t, size_t height_t);
+
+/// Write a portable float map (grayscale or RGB)
+extern void writePFM(const std::string &filename, const ImageView &image);
+
+/**
+ * Write a header followed by the densely packed rows of an image
+ * (optionally bottom to top)
+ */
+extern void writeFloatData(const std::string &filename, const std::string &header,
+    const ImageView &image, bool bottomUp);
+
+/**
+ * Write the pixels as headerless 32 bit floats, along with a JSON sidecar
+ * file ('filename'.json) that describes the layout and holds the metadata
+ */
+extern void writeRawFloat(const std::string &filename, const ImageView &image,
+    const StringMap &metadata);
+
+/// Tone curves that can be applied when writing low dynamic range output
+enum EToneCurve {
+    ELinearTone,
+    EReinhardTone,
+    EFilmicTone
+};
+
+extern std::istream& operator>>(std::istream& in, EToneCurve& unit);
+
+/// Options that control the conversion to 8 bit sRGB values when writing JPEG files
+struct JPEGOptions {
+    int quality;
+
+    /* Exposure adjustment in stops */
+    float exposure;
+
+    EToneCurve toneCurve;
+
+    inline JPEGOptions() : quality(100), exposure(0.0f), toneCurve(ELinearTone) { }
+};
+
+extern void writeJPEG(const std::string &filename, const ImageView &image,
+    const JPEGOptions &options = JPEGOptions());
+
+/**
+ * Write a sequence of downscaled JPEG previews whose longest side matches
+ * the entries of 'sizes'. The previews are computed from one another
+ * (largest first), so that each step only needs to filter a small image.
+ * Returns the names of the files that were written
+ */
+extern std::vector<std::string> writePreviews(const std::string &basename, const ImageView &image,
+    std::vector<int> sizes, const JPEGOptions &options = JPEGOptions());
+
+/// Incrementally compute the 64-bit FNV-1a hash of a sequence of bytes
+inline uint64_t fnv1a(const void *data, size_t size, uint64_t hash = 0xCBF29CE484222325ULL) {
+    const uint8_t *ptr = (const uint8_t *) data;
+    for (size_t i=0; i<size; ++i)
+        hash = (hash ^ ptr[i]) * 0x100000001B3ULL;
+    return hash;
+}
 
-void writeJPEG(const std::string &filename, size_t w, size_t h, float *data, int quality = 100);
+inline uint64_t fnv1a(const std::string &str, uint64_t hash = 0xCBF29CE484222325ULL) {
+    /* Include the terminating zero, so that consecutive strings can't be confused */
+    return fnv1a(str.c_str(), str.length() + 1, hash);
+}
 
-/// Generate a uniformly distributed random number in [0, 1)
-inline float randf() {
-    #define RS_SCALE (1.0f / (1.0f + RAND_MAX))
-    float f;
-    do {
-       f = (((rand () * RS_SCALE) + rand ()) * RS_SCALE + rand()) * RS_SCALE;
-    } while (f >= 1); /* Round off */
+/// 64-bit integer hash function (the finalizer of SplitMix64)
+inline uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
 
-    return f;
+/**
+ * Counter-based random number generator: returns a uniformly distributed
+ * number in [0, 1) that only depends on the arguments. This makes it safe
+ * to draw samples from several threads in any order.
+ */
+inline float randf(uint64_t seed, uint64_t stream, uint64_t counter) {
+    uint64_t z = mix64(seed + 0x9E3779B97F4A7C15ULL);
+    z = mix64(z ^ stream);
+    z = mix64(z ^ counter);
+    return (z >> 40) * (1.0f / (1 << 24));
 }
 
 inline float clamp(float value, float min, float max) {
@@ -235,30 +648,14 @@ inline float square(float value) {
 /// check if a file exists
 bool fexists(const std::string& name);
 
-enum ERotateFlipType {
-    ERotateNoneFlipNone = 0,
-    ERotate180FlipXY    = ERotateNoneFlipNone,
-    ERotate90FlipNone   = 1,
-    ERotate270FlipXY    = ERotate90FlipNone,
-    ERotate180FlipNone  = 2,
-    ERotateNoneFlipXY   = ERotate180FlipNone,
-    ERotate270FlipNone  = 3,
-    ERotate90FlipXY     = ERotate270FlipNone,
-    ERotateNoneFlipX    = 4,
-    ERotate180FlipY     = ERotateNoneFlipX,
-    ERotate90FlipX      = 5,
-    ERotate270FlipY     = ERotate90FlipX,
-    ERotate180FlipX     = 6,
-    ERotateNoneFlipY    = ERotate180FlipX,
-    ERotate270FlipX     = 7,
-    ERotate90FlipY      = ERotate270FlipX
-};
-
-// Rotate and/or flip an arbitrary image
+/**
+ * Rotate and/or flip an arbitrary image. The rows of the source are
+ * 's_stride' bytes apart (or densely packed, if zero)
+ */
 extern void rotateFlip(
         uint8_t *src,  size_t  s_width, size_t  s_height,
         uint8_t *&dst, size_t &t_width, size_t &t_height,
-        int bypp, ERotateFlipType type);
+        int bypp, ERotateFlipType type, size_t s_stride = 0);
 
 extern ERotateFlipType flipTypeFromString(int rotation, std::string axes);
 
@@ -270,4 +667,36 @@ enum EColorMode {
 
 extern std::istream& operator>>(std::istream& in, EColorMode& unit);
 
+/**
+ * Content-addressed cache of output files. Each entry is a directory named
+ * after a job hash (which covers the inputs and all options) that holds a
+ * copy of the files written by that job. When the total size exceeds
+ * 'maxSize' bytes, the least recently used entries are removed.
+ */
+class ResultCache {
+public:
+    ResultCache(const std::string &path, uint64_t maxSize);
+
+    /// Hash the location, size and modification time (or optionally, only the contents) of an input file
+    static uint64_t hashFile(const std::string &filename, bool content, uint64_t hash);
+
+    /// Try to restore the output files of job 'key' (returns false on a cache miss)
+    bool restore(uint64_t key);
+
+    /// Store the output files of job 'key'
+    void store(uint64_t key, const std::vector<std::string> &files);
+
+    /// Print the number of entries, their size and the hit rate
+    void printStatistics() const;
+
+private:
+    std::string entryPath(uint64_t key) const;
+    void updateStatistics(bool hit);
+    void evict(const std::string &keep);
+
+private:
+    std::string m_path;
+    uint64_t m_maxSize;
+};
+
 #endif /* __HDRMERGE_H */
@@ -0,0 +1,115 @@
+#if !defined(__HDRMERGE_C_H)
+#define __HDRMERGE_C_H
+
+/*
+ * C interface of libhdrmerge. It exposes the processing steps of the
+ * 'hdrmerge' command line tool, so that they can be embedded into other
+ * applications without writing intermediate files.
+ *
+ * All functions that can fail return HDRMERGE_OK on success. Otherwise,
+ * hdrmerge_last_error() returns a description of the problem. A series
+ * must not be used by several threads at the same time (this includes the
+ * functions taking a const series, since they also record errors).
+ */
+
+#include <stddef.h>
+
+#if defined(_WIN32)
+    #if defined(HDRMERGE_BUILD)
+        #define HDRMERGE_EXPORT __declspec(dllexport)
+    #else
+        #define HDRMERGE_EXPORT __declspec(dllimport)
+    #endif
+#else
+    #define HDRMERGE_EXPORT __attribute__((visibility("default")))
+#endif
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/* Incremented whenever the interface changes in an incompatible way */
+#define HDRMERGE_API_VERSION 1
+
+#define HDRMERGE_OK     0
+#define HDRMERGE_ERROR -1
+
+/* Reconstruction filters that can be used for resampling */
+typedef enum hdrmerge_filter {
+    HDRMERGE_FILTER_LANCZOS = 0,
+    HDRMERGE_FILTER_TENT,
+    HDRMERGE_FILTER_BOX
+} hdrmerge_filter;
+
+/* Opaque handle of an exposure series */
+typedef struct hdrmerge_series hdrmerge_series;
+
+/* Return the value of HDRMERGE_API_VERSION the library was compiled with */
+HDRMERGE_EXPORT int hdrmerge_api_version(void);
+
+/* Create and destroy an exposure series */
+HDRMERGE_EXPORT hdrmerge_series *hdrmerge_create(void);
+HDRMERGE_EXPORT void hdrmerge_destroy(hdrmerge_series *series);
+
+/* Return a description of the last error (or an empty string) */
+HDRMERGE_EXPORT const char *hdrmerge_last_error(const hdrmerge_series *series);
+
+/* Location of RawSpeed's "cameras.xml" (by default, it is searched next to the executable) */
+HDRMERGE_EXPORT int hdrmerge_set_camera_data(hdrmerge_series *series, const char *path);
+
+/* Add a RAW file (or a printf-style sequence such as "file_%03i.cr2", or "-" for standard input) */
+HDRMERGE_EXPORT int hdrmerge_add_file(hdrmerge_series *series, const char *filename);
+
+/*
+ * Add a RAW file that is already in memory ('name' is only used in messages).
+ * The data is copied, hence the buffer can be released after the call
+ */
+HDRMERGE_EXPORT int hdrmerge_add_memory(hdrmerge_series *series, const char *name,
+    const void *data, size_t size);
+
+/* Return the number of exposures that have been added so far */
+HDRMERGE_EXPORT size_t hdrmerge_exposure_count(const hdrmerge_series *series);
+
+/* Check the exposures for consistency and decode the RAW data */
+HDRMERGE_EXPORT int hdrmerge_load(hdrmerge_series *series);
+
+/* Merge the exposures into a Bayer grid ('saturation' <= 0: detect automatically) */
+HDRMERGE_EXPORT int hdrmerge_merge(hdrmerge_series *series, float saturation);
+
+/*
+ * Demosaic the merged Bayer grid, or compute a luminance image. 'sensor2xyz'
+ * is a row-major 3x3 matrix, or NULL to use the sRGB primaries
+ */
+HDRMERGE_EXPORT int hdrmerge_demosaic(hdrmerge_series *series, const float *sensor2xyz);
+HDRMERGE_EXPORT int hdrmerge_luminance(hdrmerge_series *series, const float *sensor2xyz);
+
+/* Transform the demosaiced image from sensor colors to sRGB (xyz == 0) or XYZ (xyz != 0) */
+HDRMERGE_EXPORT int hdrmerge_transform_color(hdrmerge_series *series,
+    const float *sensor2xyz, int xyz);
+
+/* Multiply the color channels by 'scale[0..2]' */
+HDRMERGE_EXPORT int hdrmerge_whitebalance(hdrmerge_series *series, const float *scale);
+
+/* Scale the brightness of the image */
+HDRMERGE_EXPORT int hdrmerge_scale(hdrmerge_series *series, float factor);
+
+/* Resample the current image to the resolution width x height */
+HDRMERGE_EXPORT int hdrmerge_resample(hdrmerge_series *series, hdrmerge_filter filter,
+    size_t width, size_t height);
+
+/* Return the resolution and number of channels (1 or 3) of the current image */
+HDRMERGE_EXPORT int hdrmerge_image_size(const hdrmerge_series *series,
+    size_t *width, size_t *height, int *channels);
+
+/*
+ * Copy the current image into a caller-owned buffer of interleaved floats.
+ * Rows are 'row_stride' floats apart (zero: densely packed)
+ */
+HDRMERGE_EXPORT int hdrmerge_copy_image(const hdrmerge_series *series,
+    float *buffer, size_t row_stride);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* __HDRMERGE_C_H */
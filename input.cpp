@@ -10,6 +10,11 @@
 #include <mach-o/dyld.h>
 #endif
 
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#endif
+
 #include <sys/stat.h>
 #include <boost/filesystem.hpp>
 #include <boost/format.hpp>
@@ -57,6 +62,11 @@ std::string getexepath() {
  *  - there are no duplicate exposures.
  */
 void ExposureSeries::add(const std::string &fmt) {
+    if (fmt == "-") {
+        addStdin();
+        return;
+    }
+
     bool success = false;
 
     for (int exposure = 0; ; ++exposure) {
@@ -89,6 +99,110 @@ void ExposureSeries::add(const std::string &fmt) {
     }
 }
 
+void ExposureSeries::add(const std::string &name, std::vector<uint8_t> &&data) {
+    if (data.empty())
+        throw std::runtime_error("\"" + name + "\": the RAW file is empty!");
+    if (data.size() > 0xFFFFFFFFu - FILEMAP_MARGIN)
+        throw std::runtime_error("\"" + name + "\": the RAW file is too large!");
+
+    /* RawSpeed may read a few bytes past the end -- pad the buffer once, so that
+       it can later be decoded without reallocating or modifying it */
+    data.resize(data.size() + FILEMAP_MARGIN);
+
+    Exposure exp(name);
+    exp.buffer = std::make_shared<std::vector<uint8_t>>(std::move(data));
+    exposures.push_back(exp);
+}
+
+void ExposureSeries::add(const std::string &name, const uint8_t *data, size_t size) {
+    std::vector<uint8_t> buffer;
+    buffer.reserve(size + FILEMAP_MARGIN); /* Room for the padding, so that the file is copied only once */
+    buffer.assign(data, data + size);
+    add(name, std::move(buffer));
+}
+
+/// Read exactly 'size' bytes from standard input (returns false at the end of the stream)
+static bool readStdin(uint8_t *data, size_t size, std::vector<uint8_t> &pending) {
+    size_t n = std::min(size, pending.size());
+    memcpy(data, pending.data(), n);
+    pending.erase(pending.begin(), pending.begin() + n);
+
+    n += fread(data + n, 1, size - n, stdin);
+    if (n == size)
+        return true;
+    else if (n == 0)
+        return false;
+    throw std::runtime_error("Unexpected end of the input stream!");
+}
+
+void ExposureSeries::addStdin() {
+    #if defined(_WIN32)
+        _setmode(_fileno(stdin), _O_BINARY);
+    #endif
+
+    /* Peek at the first block to distinguish a tar archive from a frame stream */
+    std::vector<uint8_t> pending(512);
+    pending.resize(fread(pending.data(), 1, pending.size(), stdin));
+    bool tar = pending.size() == 512 && memcmp(&pending[257], "ustar", 5) == 0;
+    size_t count = 0;
+
+    if (tar) {
+        std::string longName;
+        uint8_t header[512];
+
+        while (readStdin(header, sizeof(header), pending) && header[0] != '\0') {
+            char type = (char) header[156];
+            std::string name((const char *) header, strnlen((const char *) header, 100));
+            size_t size = (size_t) strtoull(std::string((const char *) header + 124, 12).c_str(), NULL, 8);
+            size_t padded = (size + 511) & ~((size_t) 511);
+
+            std::vector<uint8_t> data;
+            data.reserve(padded + FILEMAP_MARGIN); /* Room for the padding added by add() */
+            data.resize(padded);
+            if (padded > 0 && !readStdin(data.data(), padded, pending))
+                throw std::runtime_error("Unexpected end of the tar archive!");
+            data.resize(size);
+
+            if (type == 'L') {
+                /* GNU extension: long name of the next entry */
+                longName.assign(data.begin(), std::find(data.begin(), data.end(), '\0'));
+                continue;
+            } else if (type != '0' && type != '\0') {
+                longName.clear();
+                continue; /* Skip directories, links etc. */
+            }
+
+            if (!longName.empty())
+                name = longName;
+            longName.clear();
+
+            add(name, std::move(data));
+            ++count;
+        }
+    } else {
+        uint8_t prefix[8];
+        while (readStdin(prefix, sizeof(prefix), pending)) {
+            uint64_t size = 0;
+            for (int i=7; i>=0; --i)
+                size = (size << 8) | prefix[i];
+            if (size == 0 || size > 0xFFFFFFFFu)
+                throw std::runtime_error("Invalid frame length in the input stream!");
+
+            std::vector<uint8_t> data;
+            data.reserve((size_t) size + FILEMAP_MARGIN);
+            data.resize((size_t) size);
+            if (!readStdin(data.data(), data.size(), pending))
+                throw std::runtime_error("Unexpected end of the input stream!");
+
+            add((boost::format("<stdin>:%i") % count).str(), std::move(data));
+            ++count;
+        }
+    }
+
+    cout << "Read " << count << " RAW file" << (count != 1 ? "s" : "")
+         << " from standard input" << endl;
+}
+
 float exposureTime(float shutterSpeedValue) {
     /* lifted from libexiv2 */
     double tmp = std::exp(std::log(2.0) * shutterSpeedValue);
@@ -98,17 +212,69 @@ float exposureTime(float shutterSpeedValue) {
         return (int) (1/tmp + 0.5);
 }
 
+/// Extract the exposure settings, serial number and lens information from the EXIF tags
+static void readExposureInfo(Exposure &exp, const Exiv2::ExifData &exifData) {
+    Exiv2::ExifData::const_iterator it =
+        exifData.findKey(Exiv2::ExifKey("Exif.Photo.ShutterSpeedValue"));
+    if (it != exifData.end()) {
+        exp.exposure = std::pow(2, -it->toFloat());
+    } else {
+        it = exifData.findKey(Exiv2::ExifKey("Exif.Photo.ExposureTime"));
+        if (it == exifData.end())
+            throw std::runtime_error("\"" + exp.filename + "\": could not extract the exposure time!");
+        exp.exposure = it->toFloat();
+    }
+
+    it = Exiv2::exposureTime(exifData);
+    if (it == exifData.end())
+        throw std::runtime_error("\"" + exp.filename + "\": could not extract the exposure time!");
+    exp.shown_exposure = it->toFloat();
+
+    it = Exiv2::isoSpeed(exifData);
+    if (it == exifData.end())
+        throw std::runtime_error("\"" + exp.filename + "\": could not extract the ISO speed!");
+    exp.isoSpeed = it->toFloat();
+
+    it = Exiv2::fNumber(exifData);
+    if (it == exifData.end())
+        throw std::runtime_error("\"" + exp.filename + "\": could not extract the aperture setting!");
+    exp.aperture = it->toFloat();
+
+    it = Exiv2::serialNumber(exifData);
+    exp.serial = it != exifData.end() ? it->toString() : "unknown";
+
+    it = Exiv2::lensName(exifData);
+    exp.lens = it != exifData.end() ? it->print(&exifData) : "unknown";
+
+    it = Exiv2::focalLength(exifData);
+    exp.focalLength = it != exifData.end() ? it->toFloat() : 0;
+}
+
+/// Open the EXIF metadata of an exposure
+static Exiv2::Image::AutoPtr openMetadata(const Exposure &exp) {
+    Exiv2::Image::AutoPtr image = exp.buffer
+        ? Exiv2::ImageFactory::open(exp.buffer->data(), (long) (exp.buffer->size() - FILEMAP_MARGIN))
+        : Exiv2::ImageFactory::open(exp.filename);
+    if (image.get() == 0)
+        throw std::runtime_error("\"" + exp.filename + "\": could not open RAW file!");
+    image->readMetadata();
+    return image;
+}
+
+void ExposureSeries::readExposureInfo() {
+    for (size_t exposure=0; exposure<exposures.size(); ++exposure) {
+        Exiv2::Image::AutoPtr image = openMetadata(exposures[exposure]);
+        ::readExposureInfo(exposures[exposure], image->exifData());
+    }
+}
+
 void ExposureSeries::check() {
-    float isoSpeed = -1, aperture = -1;
+    isoSpeed = aperture = -1;
 
     for (size_t exposure=0; exposure<exposures.size(); ++exposure) {
         Exposure &exp = exposures[exposure];
 
-        Exiv2::Image::AutoPtr image = Exiv2::ImageFactory::open(exp.filename);
-        if (image.get() == 0)
-            throw std::runtime_error("\"" + exp.filename + "\": could not open RAW file!");
-        image->readMetadata();
-
+        Exiv2::Image::AutoPtr image = openMetadata(exp);
         const Exiv2::ExifData &exifData = image->exifData();
 
         Exiv2::ExifData::const_iterator it;
@@ -127,37 +293,18 @@ void ExposureSeries::check() {
             }
         }
 
-        it = exifData.findKey(Exiv2::ExifKey("Exif.Photo.ShutterSpeedValue"));
-        if (it != exifData.end()) {
-            exp.exposure = std::pow(2, -it->toFloat());
-        } else {
-            it = exifData.findKey(Exiv2::ExifKey("Exif.Photo.ExposureTime"));
-            if (it == exifData.end())
-                throw std::runtime_error("\"" + exp.filename + "\": could not extract the exposure time!");
-            exp.exposure = it->toFloat();
-        }
-
-        it = Exiv2::exposureTime(exifData);
-        if (it == exifData.end())
-            throw std::runtime_error("\"" + exp.filename + "\": could not extract the exposure time!");
-        exp.shown_exposure = it->toFloat();
+        ::readExposureInfo(exp, exifData);
 
         /* Fail if the images use different ISO values */
-        it = Exiv2::isoSpeed(exifData);
-        if (it == exifData.end())
-            throw std::runtime_error("\"" + exp.filename + "\": could not extract the ISO speed!");
         if (exposure == 0)
-            isoSpeed = it->toFloat();
-        else if (isoSpeed != it->toFloat())
+            isoSpeed = exp.isoSpeed;
+        else if (isoSpeed != exp.isoSpeed)
             throw std::runtime_error("\"" + exp.filename + "\": detected an ISO speed that is different from the other images!");
 
         /* Fail if the images use different aperture settings */
-        it = Exiv2::fNumber(exifData);
-        if (it == exifData.end())
-            throw std::runtime_error("\"" + exp.filename + "\": could not extract the aperture setting!");
         if (exposure == 0)
-            aperture = it->toFloat();
-        else if (aperture != it->toFloat())
+            aperture = exp.aperture;
+        else if (aperture != exp.aperture)
             throw std::runtime_error("\"" + exp.filename + "\": detected an aperture setting that is different from the other images!");
 
         /* Check for exposure mode, possibly warn */
@@ -229,7 +376,11 @@ void ExposureSeries::load() {
     std::string candidate2 = basedir + "/" + candidate1;
     std::string candidate3 = basedir + "/cameras.xml";
 
-    if (fexists(candidate1))
+    if (!cameraData.empty()) {
+        if (!fexists(cameraData))
+            throw std::runtime_error("Unable to find the camera database \"" + cameraData + "\"");
+        metadata.reset(new CameraMetaData(cameraData.c_str()));
+    } else if (fexists(candidate1))
         metadata.reset(new CameraMetaData(candidate1.c_str()));
     else if (fexists(candidate2))
         metadata.reset(new CameraMetaData(candidate2.c_str()));
@@ -245,14 +396,22 @@ void ExposureSeries::load() {
 
     #pragma omp parallel for schedule(dynamic, 1)
     for (int i=0; i<(int) exposures.size(); ++i) {
-        #ifdef _MSC_VER
-            wchar_t wresult[1024];
-            std::mbstowcs(wresult, exposures[i].filename.c_str(), 1024);
-            FileReader f(wresult);
-        #else
-            FileReader f((char *)exposures[i].filename.c_str());
-        #endif
-        std::unique_ptr<FileMap> map(f.readFile());
+        std::unique_ptr<FileMap> map;
+        std::shared_ptr<std::vector<uint8_t>> buffer = exposures[i].buffer;
+
+        if (buffer) {
+            /* Decode directly from memory (the buffer already includes the margin, see add()) */
+            map.reset(new FileMap(buffer->data(), (uint32) (buffer->size() - FILEMAP_MARGIN)));
+        } else {
+            #ifdef _MSC_VER
+                wchar_t wresult[1024];
+                std::mbstowcs(wresult, exposures[i].filename.c_str(), 1024);
+                FileReader f(wresult);
+            #else
+                FileReader f((char *)exposures[i].filename.c_str());
+            #endif
+            map.reset(f.readFile());
+        }
 
         RawParser parser(map.get());
         std::unique_ptr<RawDecoder> decoder(parser.getDecoder());
@@ -292,8 +451,21 @@ void ExposureSeries::load() {
         uint16_t *data = (uint16_t *) raw->getData(0, 0);
         uint16_t *image = new uint16_t[width*height];
 
-        for (int y=0; y<height; ++y)
-            memcpy(image+y*width, data+y*pitch, sizeof(uint16_t)*width);
+        /* Build per-color histograms while copying the rows */
+        uint32_t filter = cfa.getDcrawFilter();
+        std::vector<uint32_t> &histogram = exposures[i].histogram;
+        histogram.assign(4 * 0x10000, 0);
+
+        for (int y=0; y<height; ++y) {
+            uint16_t *row = image + y*width;
+            memcpy(row, data+y*pitch, sizeof(uint16_t)*width);
+
+            uint32_t *hist[2];
+            for (int x=0; x<2; ++x)
+                hist[x] = &histogram[(filter >> (((y << 1 & 14) + x) << 1) & 3) << 16];
+            for (int x=0; x<width; ++x)
+                hist[x & 1][row[x]]++;
+        }
 
         exposures[i].image = image;
 
@@ -304,9 +476,32 @@ void ExposureSeries::load() {
         }
     }
 
+    /* The in-memory RAW files aren't needed anymore. (They are kept until every exposure
+       has been decoded, so that a failed load() can be retried) */
+    for (size_t i=0; i<exposures.size(); ++i)
+        exposures[i].buffer.reset();
+
     cout << " done (" << width << "x" << height << ", using "
          << (width*height*sizeof(uint16_t) * exposures.size()) / (float) (1024*1024)
          << " MiB of memory)" << endl;
+
+    /* Sanity check of the black level: read noise puts at most about half of
+       the black pixels below it, so this should never happen for most of an exposure */
+    for (size_t i=0; i<exposures.size(); ++i) {
+        for (int color=0; color<4; ++color) {
+            const uint32_t *hist = &exposures[i].histogram[color << 16];
+            size_t below = 0, total = 0;
+            for (int value=0; value<0x10000; ++value) {
+                if (value < blacklevel)
+                    below += hist[value];
+                total += hist[value];
+            }
+            if (total > 0 && below > total * 3 / 4)
+                cerr << "Warning: " << (100.0f * below) / total << "% of the pixels of color " << color
+                     << " in \"" << exposures[i].filename << "\" are below the black level ("
+                     << blacklevel << ") -- it may be incorrect!" << endl;
+        }
+    }
 }
 
 int rawspeed_get_number_of_processor_cores() {
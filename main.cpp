@@ -4,6 +4,7 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/format.hpp>
 #include <fstream>
+#include <future>
 #include "hdrmerge.h"
 
 namespace po = boost::program_options;
@@ -46,6 +47,89 @@ template <typename T> std::vector<T> parse_list(const po::variables_map &vm,
     return result;
 }
 
+/// Convert the value of an option into a string (for the job hash of the result cache)
+static std::string optionString(const po::variable_value &option) {
+    const boost::any &value = option.value();
+    if (value.empty())
+        return "";
+    else if (const std::string *v = boost::any_cast<std::string>(&value))
+        return *v;
+    else if (const std::vector<std::string> *v = boost::any_cast<std::vector<std::string>>(&value))
+        return boost::algorithm::join(*v, "\n");
+    else if (const float *v = boost::any_cast<float>(&value))
+        return (boost::format("%.9g") % *v).str();
+    else if (const int *v = boost::any_cast<int>(&value))
+        return boost::lexical_cast<std::string>(*v);
+    else if (const uint64_t *v = boost::any_cast<uint64_t>(&value))
+        return boost::lexical_cast<std::string>(*v);
+    else if (const EColorMode *v = boost::any_cast<EColorMode>(&value))
+        return boost::lexical_cast<std::string>((int) *v);
+    else if (const EEXRCompression *v = boost::any_cast<EEXRCompression>(&value))
+        return boost::lexical_cast<std::string>((int) *v);
+    else if (const EEXRLevels *v = boost::any_cast<EEXRLevels>(&value))
+        return boost::lexical_cast<std::string>((int) *v);
+    else if (const EEXRLineOrder *v = boost::any_cast<EEXRLineOrder>(&value))
+        return boost::lexical_cast<std::string>((int) *v);
+    else if (const EToneCurve *v = boost::any_cast<EToneCurve>(&value))
+        return boost::lexical_cast<std::string>((int) *v);
+    else if (const ECheckpointStage *v = boost::any_cast<ECheckpointStage>(&value))
+        return boost::lexical_cast<std::string>((int) *v);
+    throw std::runtime_error("Unable to compute the job hash: unsupported option type!");
+}
+
+/// Return true if the vignetting correction is looked up in the flat-field cache
+static bool usesFlatField(const po::variables_map &vm) {
+    return vm.count("flatcache") && !vm.count("vcal") && !vm.count("vcorr");
+}
+
+/// Compute the job hash of the result cache from the input files and all options that affect the output
+static uint64_t jobHash(const po::variables_map &vm, const ExposureSeries &es,
+        const std::vector<std::pair<std::string, std::string>> &outputs) {
+    uint64_t hash = fnv1a(std::string("hdrmerge result cache v1"));
+    bool content = vm.count("cache-content") != 0;
+
+    for (po::variables_map::const_iterator it = vm.begin(); it != vm.end(); ++it) {
+        const std::string &name = it->first;
+        if (boost::starts_with(name, "cache") || name == "input-files" || name == "profile")
+            continue;
+        hash = fnv1a(name, hash);
+        /* With --cache-content, the files behind these paths are identified by their contents */
+        if (content && (name == "dark" || name == "darkcache" || name == "flatcache" || name == "resume-from"))
+            continue;
+        hash = fnv1a(optionString(it->second), hash);
+    }
+
+    /* A cache hit restores the files under the names stored in the entry. The default output
+       name is derived from the input path, so the resolved names must be part of the key */
+    for (size_t i=0; i<outputs.size(); ++i) {
+        hash = fnv1a(outputs[i].first, hash);
+        hash = fnv1a(outputs[i].second, hash);
+    }
+
+    for (size_t i=0; i<es.size(); ++i)
+        hash = ResultCache::hashFile(es.exposures[i].filename, content, hash);
+
+    if (vm.count("resume-from"))
+        hash = ResultCache::hashFile(vm["resume-from"].as<std::string>(), content, hash);
+
+    /* Dark frames and cached master darks (not used when resuming from a checkpoint) */
+    if (vm.count("dark") && !vm.count("resume-from")) {
+        std::vector<std::string> darks = es.darkFrameFiles(vm["dark"].as<std::string>(),
+            vm.count("darkcache") ? vm["darkcache"].as<std::string>() : "");
+        for (size_t i=0; i<darks.size(); ++i)
+            hash = ResultCache::hashFile(darks[i], content, hash);
+    }
+
+    /* Flat-field cache entry that will be looked up instead of --vcorr (if it exists) */
+    if (usesFlatField(vm)) {
+        std::string entry = es.flatFieldFile(vm["flatcache"].as<std::string>());
+        if (!entry.empty() && std::ifstream(entry.c_str()).good())
+            hash = ResultCache::hashFile(entry, content, hash);
+    }
+
+    return hash;
+}
+
 void help(char **argv, const po::options_description &desc) {
     cout << "RAW to HDR merging tool, written by Wenzel Jakob <wenzel@cs.cornell.edu>" << endl
         << "Version 1.0 (May 2013). Source @ https://github.com/wjakob/hdrmerge" << endl
@@ -87,6 +171,10 @@ void help(char **argv, const po::options_description &desc) {
         << "  the RawSpeed source code to support new camera models. To do this, run the" << endl
         << "  'rawspeed/update_rawspeed.sh' shell script and recompile." << endl
         << endl
+        << "  Instead of file names, '-' reads the RAW files from standard input. This can" << endl
+        << "  either be a tar archive, or a sequence of frames that each consist of a" << endl
+        << "  64-bit little endian length followed by the contents of a RAW file." << endl
+        << endl
         << "Step 2: Merge" << endl
         << "  Exposures are merged based on a simple Poisson noise model. In other words," << endl
         << "  the exposures are simply summed together and divided by the total exposure." << endl
@@ -119,18 +207,30 @@ void help(char **argv, const po::options_description &desc) {
         << "  (search for these keywords online to find videos that demonstrate" << endl
         << "  how it works)." << endl
         << endl
+        << "  Dark frames (exposures taken with the lens cap on) can be subtracted during" << endl
+        << "  this step using the --dark parameter. Frames with the same exposure time" << endl
+        << "  are averaged into a master dark, which is cached on disk (keyed by the" << endl
+        << "  camera serial number, ISO speed and exposure time) for subsequent runs." << endl
+        << endl
         << "Step 3: Demosaic" << endl
         << "  This program uses Adaptive Homogeneity-Directed demosaicing (AHD) to" << endl
         << "  interpolate colors over the image. Importantly, demosaicing is done *after*" << endl
         << "  HDR merging, on the resulting floating point-valued Bayer grid." << endl
         << endl
+        << "  The merged Bayer grid (or the demosaiced image) can be saved using" << endl
+        << "  --checkpoint. Passing this file to --resume-from skips all preceding steps," << endl
+        << "  which makes it cheap to try different settings for the remaining ones." << endl
+        << endl
         << "Step 7: Vignetting correction" << endl
         << "  To remove vignetting from your photographs, take a single well-exposed " << endl
         << "  picture of a uniformly colored object. Ideally, take a picture through " << endl
         << "  the opening of an integrating sphere, if you have one. Then run hdrmerge" << endl
         << "  on this picture using the --vcal parameter. This fits a radial polynomial" << endl
         << "  of the form 1 + ax^2 + bx^4 + cx^6 to the image and prints out the" << endl
-        << "  coefficients. These can then be passed using the --vcorr parameter" << endl
+        << "  coefficients. These can then be passed using the --vcorr parameter." << endl
+        << "  Alternatively, specify a directory using --flatcache: the coefficients" << endl
+        << "  are then stored for the current camera, lens, focal length and aperture and" << endl
+        << "  automatically applied to subsequent images taken with the same settings." << endl
         << endl
         << "Step 9: Resample" << endl
         << "  This program can do high quality Lanczos resampling to get lower resolution" << endl
@@ -164,12 +264,25 @@ int main(int argc, char **argv) {
         ("saturation", po::value<float>(),
             "Saturation threshold of the sensor: the ratio of the sensor's theoretical dynamic "
             "range, at which saturation occurs in practice (in [0,1]). Estimated automatically if not specified.\n")
+        ("stats", po::value<std::string>(),
+            "Write statistics of the raw data (per exposure and color channel) to the JSON file 'arg'\n")
         ("fitexptimes", "On some cameras, the exposure times in the EXIF tags can't be trusted. Use "
             "this parameter to estimate them automatically for the current image sequence\n")
+        ("seed", po::value<uint64_t>()->default_value(0),
+            "Seed of the random patch sampling used by --fitexptimes. The fit is reproducible for a given seed\n")
         ("exptimes", po::value<std::string>(),
             "Override the EXIF exposure times with a manually specified sequence of the "
             "format 'time1,time2,time3,..'\n")
+        ("dark", po::value<std::string>(),
+            "Subtract dark frames during the merging step. 'arg' is a printf-style format string "
+            "or a single file name (e.g. dark_%02i.cr2). Frames with the same exposure time are "
+            "averaged into a master dark, which is cached for subsequent runs\n")
+        ("darkcache", po::value<std::string>(),
+            "Directory for cached master dark frames (defaults to the directory containing the dark frames)\n")
         ("nodemosaic", "If specified, the raw Bayer grid is exported as a grayscale EXR file\n")
+        ("grayscale", "Write a single-channel luminance (Y) image. This replaces AHD demosaicing "
+            "with a cheap bilinear interpolation of the Bayer grid and processes only one "
+            "channel in all subsequent steps\n")
         ("colormode", po::value<EColorMode>()->default_value(ESRGB, "sRGB"),
             "Output color space (one of 'native'/'sRGB'/'XYZ')\n")
         ("sensor2xyz", po::value<std::string>(),
@@ -185,6 +298,9 @@ int main(int argc, char **argv) {
         ("rfilter", po::value<std::string>()->default_value("lanczos"),
             "Resampling filter used by the --resample option (available choices: "
             "'tent' or 'lanczos')\n")
+        ("fulldemosaic", "Always demosaic at full resolution. By default, when --resample reduces the image "
+            "to a quarter of the sensor resolution or less, the Bayer color planes are instead downsampled "
+            "directly (which is much faster)\n")
         ("wbalpatch", po::value<std::string>(),
             "White balance the image using a grey patch occupying the region "
             "'arg' (specified as x,y,width,height). Prints output suitable for --wbal\n")
@@ -194,15 +310,67 @@ int main(int argc, char **argv) {
         ("vcal", "Calibrate vignetting correction given a uniformly illuminated image\n")
         ("vcorr", po::value<std::string>(),
             "Apply the vignetting correction computed using --vcal\n")
+        ("flatcache", po::value<std::string>(),
+            "Directory of cached vignetting corrections, keyed by camera, lens, focal length and aperture. "
+            "--vcal stores its result there, and later runs without --vcorr look it up automatically\n")
         ("flip", po::value<std::string>()->default_value(""), "Flip the output image along the "
           "specified axes (one of 'x', 'y', or 'xy')\n")
         ("rotate", po::value<int>()->default_value(0), "Rotate the output image by 90, 180 or 270 degrees\n")
         ("format", po::value<std::string>()->default_value("half"),
           "Choose the desired output file format -- one of 'half' (OpenEXR, 16 bit HDR / half precision), "
-          "'single' (OpenEXR, 32 bit / single precision), 'jpeg' (libjpeg, 8 bit LDR for convenience)\n")
-        ("output", po::value<std::string>()->default_value("output.exr"),
-            "Name of the output file in OpenEXR format. When only a single RAW file is processed, its "
-            "name is used by default (with the ending replaced by .exr/.jpeg");
+          "'single' (OpenEXR, 32 bit / single precision), 'jpeg' (libjpeg, 8 bit LDR for convenience), "
+          "'pfm' (portable float map) or 'rawf32' (headerless 32 bit floats with a JSON sidecar file "
+          "describing the layout, e.g. for numpy.memmap)\n")
+        ("previews", po::value<std::string>(),
+            "Also write downscaled JPEG previews of the output in the same run. 'arg' is a "
+            "list of sizes of the longest side (e.g. 1024,256), and the files are named after "
+            "the output file (e.g. output_1024.jpg)\n")
+        ("jpeg-exposure", po::value<float>()->default_value(0.0f, "0"),
+            "Exposure adjustment (in stops) applied to JPEG output and previews\n")
+        ("jpeg-tonecurve", po::value<EToneCurve>()->default_value(ELinearTone, "linear"),
+            "Tone curve applied to JPEG output and previews before the sRGB encoding (one of "
+            "'linear', 'reinhard' or 'filmic'). The 'linear' curve clips values above 1\n")
+        ("exr-compression", po::value<EEXRCompression>()->default_value(EEXRZIP, "zip"),
+            "Compression used for OpenEXR output (one of 'none', 'rle', 'zips', 'zip', 'piz', 'pxr24', "
+            "'b44', 'dwaa' or 'dwab'). Note that 'pxr24', 'b44' and the DWA variants are lossy\n")
+        ("exr-tiles", po::value<std::string>(),
+            "Write a tiled OpenEXR file with tiles of the given size (e.g. 64x64)\n")
+        ("exr-levels", po::value<EEXRLevels>()->default_value(EEXROneLevel, "one"),
+            "Resolution levels of OpenEXR output (one of 'one', 'mipmap' or 'ripmap'). Multiple levels "
+            "imply a tiled file (with 64x64 tiles unless --exr-tiles is specified)\n")
+        ("exr-lineorder", po::value<EEXRLineOrder>()->default_value(EEXRIncreasingY, "increasing"),
+            "Order in which OpenEXR scanlines or tiles are stored (one of 'increasing', 'decreasing' "
+            "or 'random' -- the last one is only available for tiled files)\n")
+        ("profile", "Print the time taken to write OpenEXR output, its throughput and the achieved "
+            "compression ratio\n")
+        ("cache", po::value<std::string>(),
+            "Directory of a result cache. Jobs are identified by a hash of the input files and all "
+            "options, and a repeated job restores its output files from the cache instead of "
+            "running the pipeline\n")
+        ("cache-size", po::value<float>()->default_value(4096.0f, "4096"),
+            "Maximum size of the result cache in MiB. The least recently used entries are removed "
+            "when it is exceeded (0: unlimited)\n")
+        ("cache-content", "Identify input files of the result cache by hashing their contents "
+            "(by default, their location, size and modification time are used)\n")
+        ("cache-stats", "Print the size and the hit rate of the result cache\n")
+        ("checkpoint", po::value<std::string>(),
+            "Save the intermediate result of the stage selected by --checkpoint-stage to the file 'arg'. "
+            "It can be passed to --resume-from, so that later steps can be repeated with different "
+            "parameters (e.g. --wbal, --sensor2xyz, --crop or --resample) without loading and merging "
+            "the RAW files again\n")
+        ("checkpoint-stage", po::value<ECheckpointStage>()->default_value(ECheckpointMerged, "merged"),
+            "Stage saved by --checkpoint: 'merged' (the merged Bayer grid) or 'demosaiced' (the "
+            "demosaiced image in sensor colors, before any of the steps 4-10)\n")
+        ("resume-from", po::value<std::string>(),
+            "Skip the loading and merging steps (and demosaicing, for 'demosaiced' checkpoints) and "
+            "continue with the checkpoint file 'arg'. No RAW files need to be specified in this case\n")
+        ("output", po::value<std::vector<std::string>>(),
+            "Name of the output file in OpenEXR format (default: output.exr). When only a single RAW file "
+            "is processed, its name is used by default (with the ending replaced by .exr/.jpeg). This option "
+            "can be given several times to write multiple files from the same run. Each name can have a "
+            "':format' suffix that overrides --format, which additionally accepts 'raw' (the merged Bayer "
+            "grid before demosaicing, written in the format implied by the file ending .exr/.pfm/.f32), "
+            "e.g. --output a.exr:half --output a.jpg:jpeg --output bayer.exr:raw");
 
     hidden_options.add_options()
         ("input-files", po::value<std::vector<std::string>>(), "Input files");
@@ -231,7 +399,7 @@ int main(int argc, char **argv) {
 
         po::store(po::command_line_parser(argc, argv)
             .options(all_options).positional(positional).run(), vm);
-        if (vm.count("help") || !vm.count("input-files")) {
+        if (vm.count("help") || (!vm.count("input-files") && !vm.count("resume-from"))) {
             help(argv, options);
             return 0;
         }
@@ -250,6 +418,8 @@ int main(int argc, char **argv) {
         std::vector<int> crop           = parse_list<int>(vm, "crop", { 4 });
         std::vector<float> sensor2xyz_v = parse_list<float>(vm, "sensor2xyz", { 9 });
         std::vector<float> vcorr        = parse_list<float>(vm, "vcorr", { 3 });
+        std::vector<int> exrTiles       = parse_list<int>(vm, "exr-tiles", { 1, 2 }, ", x");
+        std::vector<int> previews       = parse_list<int>(vm, "previews", { }, ",");
 
         if (!wbal.empty() && !wbalpatch.empty()) {
             cerr << "Cannot specify --wbal and --wbalpatch at the same time!" << endl;
@@ -290,114 +460,323 @@ int main(int argc, char **argv) {
             colormode = ENative;
         }
 
-        std::vector<std::string> exposures = vm["input-files"].as<std::vector<std::string>>();
+        std::vector<std::string> exposures;
+        if (vm.count("input-files"))
+            exposures = vm["input-files"].as<std::vector<std::string>>();
         float scale = 1.0f;
         if (vm.count("scale"))
             scale = vm["scale"].as<float>();
 
+        /* Resolve the names and formats of the output files */
+        std::string defaultFormat = boost::to_lower_copy(vm["format"].as<std::string>());
+        std::vector<std::string> outputSpecs;
+        if (vm.count("output")) {
+            outputSpecs = vm["output"].as<std::vector<std::string>>();
+        } else {
+            std::string output = "output.exr";
+            if (exposures.size() == 1 && exposures[0].find("%") == std::string::npos) {
+                std::string fname = exposures[0];
+                size_t spos = fname.find_last_of(".");
+                if (spos != std::string::npos)
+                    output = fname.substr(0, spos) + ".exr";
+            }
+            outputSpecs.push_back(output);
+        }
+
+        std::vector<std::pair<std::string, std::string>> outputs;
+        bool rawOutput = false;
+        for (size_t i=0; i<outputSpecs.size(); ++i) {
+            std::string output = outputSpecs[i], format = defaultFormat;
+            size_t cpos = output.find_last_of(":");
+            if (cpos != std::string::npos) {
+                std::string suffix = boost::to_lower_copy(output.substr(cpos+1));
+                if (suffix == "half" || suffix == "single" || suffix == "jpeg" || suffix == "jpg" ||
+                    suffix == "pfm" || suffix == "rawf32" || suffix == "raw") {
+                    format = suffix;
+                    output = output.substr(0, cpos);
+                }
+            }
+
+            if (format == "jpg")
+                format = "jpeg";
+
+            if (format == "jpeg" && boost::ends_with(output,  ".exr"))
+                output = output.substr(0, output.length()-4) + ".jpg";
+            else if (format == "pfm" && boost::ends_with(output,  ".exr"))
+                output = output.substr(0, output.length()-4) + ".pfm";
+            else if (format == "rawf32" && boost::ends_with(output,  ".exr"))
+                output = output.substr(0, output.length()-4) + ".f32";
+
+            if (format != "half" && format != "single" && format != "jpeg" && format != "pfm" &&
+                format != "rawf32" && format != "raw")
+                throw std::runtime_error("Unsupported output format \"" + format + "\"");
+
+            rawOutput |= format == "raw";
+            outputs.push_back(std::make_pair(output, format));
+        }
+
+        /* Checkpoints of intermediate results */
+        std::string checkpoint = vm.count("checkpoint") ? vm["checkpoint"].as<std::string>() : "";
+        ECheckpointStage checkpointStage = vm["checkpoint-stage"].as<ECheckpointStage>();
+        bool demosaicedCheckpoint = !checkpoint.empty() && checkpointStage == ECheckpointDemosaiced;
+        bool resume = vm.count("resume-from") != 0, checkpointWritten = false;
+        if (demosaicedCheckpoint && (vm.count("grayscale") || vm.count("nodemosaic")))
+            throw std::runtime_error("Demosaiced checkpoints can't be written when --grayscale "
+                "or --nodemosaic is specified!");
+        if (resume && !exposures.empty()) {
+            cerr << "Warning: resuming from a checkpoint -- ignoring the specified RAW files" << endl;
+            exposures.clear();
+        }
+
         /// Step 1: Load RAW
         ExposureSeries es;
+        es.keepMerged = rawOutput;
         for (size_t i=0; i<exposures.size(); ++i)
             es.add(exposures[i]);
-        es.check();
-        if (es.size() == 0)
-            throw std::runtime_error("No input found / list of exposures to merge is empty!");
-
-        std::vector<float> exptimes;
-        std::map<float, float> exptimes_map;
-        if (vm.count("exptimes")) {
-            std::string value = vm["exptimes"].as<std::string>();
-
-            if (value.find("->") == std::string::npos) {
-                /* Normal list of exposure times, load directly */
-                exptimes = parse_list<float>(vm, "exptimes", { es.size() });
+
+        /* Read the EXIF tags first, the result cache needs them to resolve the flat-field entry */
+        if (!resume) {
+            es.check();
+            if (es.size() == 0)
+                throw std::runtime_error("No input found / list of exposures to merge is empty!");
+        }
+
+        /// Look up the result cache (a hit skips all further steps)
+        std::unique_ptr<ResultCache> cache;
+        uint64_t cacheKey = 0;
+        if (vm.count("cache")) {
+            bool inMemory = false;
+            for (size_t i=0; i<es.size(); ++i)
+                inMemory |= (bool) es.exposures[i].buffer;
+
+            if (inMemory) {
+                cerr << "Warning: the result cache is not available for input from standard input. Ignoring.." << endl;
+            } else if (resume && usesFlatField(vm)) {
+                /* The flat-field cache entry is only known once the checkpoint is loaded */
+                cerr << "Warning: the result cache can't be combined with --flatcache when resuming "
+                     << "from a checkpoint. Ignoring.." << endl;
             } else {
-                /* Map of exposure time replacement values */
-                std::vector<std::string> map_str = parse_list<std::string>(vm, "exptimes", { }, ",");
-                for (size_t i=0; i<map_str.size(); ++i) {
-                    std::vector<std::string> v;
-                    boost::algorithm::iter_split(v, map_str[i], boost::algorithm::first_finder("->"));
-                    if (v.size() != 2)
-                        throw std::runtime_error("Unable to parse the 'exptimes' parameter");
-                    try {
-                        exptimes_map[boost::lexical_cast<float>(boost::trim_copy(v[0]))] = boost::lexical_cast<float>(boost::trim_copy(v[1]));
-                    } catch (const boost::bad_lexical_cast &) {
-                        throw std::runtime_error("Unable to parse the 'exptimes' argument!");
-                    }
+                cache.reset(new ResultCache(vm["cache"].as<std::string>(),
+                    (uint64_t) (std::max(vm["cache-size"].as<float>(), 0.0f) * 1024 * 1024)));
+                cacheKey = jobHash(vm, es, outputs);
+                if (cache->restore(cacheKey)) {
+                    if (vm.count("cache-stats"))
+                        cache->printStatistics();
+                    return 0;
                 }
             }
         }
-        es.load();
-
-        /// Precompute relative exposure + weight tables
-        float saturation = 0;
-        if (vm.count("saturation"))
-            saturation = vm["saturation"].as<float>();
-        es.initTables(saturation);
-
-        if (!exptimes.empty()) {
-            cout << "Overriding exposure times: [";
-
-            for (size_t i=0; i<exptimes.size(); ++i) {
-                cout << es.exposures[i].toString() << "->" << exptimes[i];
-                es.exposures[i].exposure = exptimes[i];
-                if (i+1 < exptimes.size())
-                    cout << ", ";
+
+        ECheckpointStage resumeStage = ECheckpointMerged;
+        if (resume) {
+            resumeStage = es.readCheckpoint(vm["resume-from"].as<std::string>());
+        } else {
+            std::vector<float> exptimes;
+            std::map<float, float> exptimes_map;
+            if (vm.count("exptimes")) {
+                std::string value = vm["exptimes"].as<std::string>();
+
+                if (value.find("->") == std::string::npos) {
+                    /* Normal list of exposure times, load directly */
+                    exptimes = parse_list<float>(vm, "exptimes", { es.size() });
+                } else {
+                    /* Map of exposure time replacement values */
+                    std::vector<std::string> map_str = parse_list<std::string>(vm, "exptimes", { }, ",");
+                    for (size_t i=0; i<map_str.size(); ++i) {
+                        std::vector<std::string> v;
+                        boost::algorithm::iter_split(v, map_str[i], boost::algorithm::first_finder("->"));
+                        if (v.size() != 2)
+                            throw std::runtime_error("Unable to parse the 'exptimes' parameter");
+                        try {
+                            exptimes_map[boost::lexical_cast<float>(boost::trim_copy(v[0]))] = boost::lexical_cast<float>(boost::trim_copy(v[1]));
+                        } catch (const boost::bad_lexical_cast &) {
+                            throw std::runtime_error("Unable to parse the 'exptimes' argument!");
+                        }
+                    }
+                }
+            }
+            es.load();
+
+            /// Load (or average) the master dark frames
+            if (vm.count("dark"))
+                es.loadDarkFrames(vm["dark"].as<std::string>(),
+                    vm.count("darkcache") ? vm["darkcache"].as<std::string>() : "");
+
+            /// Precompute relative exposure + weight tables
+            float saturation = 0;
+            if (vm.count("saturation"))
+                saturation = vm["saturation"].as<float>();
+            es.initTables(saturation);
+
+            if (vm.count("stats"))
+                es.writeStatistics(vm["stats"].as<std::string>());
+
+            if (!exptimes.empty()) {
+                cout << "Overriding exposure times: [";
+
+                for (size_t i=0; i<exptimes.size(); ++i) {
+                    cout << es.exposures[i].toString() << "->" << exptimes[i];
+                    es.exposures[i].exposure = exptimes[i];
+                    if (i+1 < exptimes.size())
+                        cout << ", ";
+                }
+                cout << "]" << endl;
             }
-            cout << "]" << endl;
-        }
 
-        if (!exptimes_map.empty()) {
-            cout << "Overriding exposure times: [";
-            for (size_t i=0; i<es.exposures.size(); ++i) {
-                float from = es.exposures[i].exposure, to = 0;
-                for (std::map<float, float>::const_iterator it = exptimes_map.begin(); it != exptimes_map.end(); ++it) {
-                    if (std::abs((it->first - from) / from) < 1e-5f) {
-                        if (to != 0)
-                            throw std::runtime_error("Internal error!");
-                        to = it->second;
+            if (!exptimes_map.empty()) {
+                cout << "Overriding exposure times: [";
+                for (size_t i=0; i<es.exposures.size(); ++i) {
+                    float from = es.exposures[i].exposure, to = 0;
+                    for (std::map<float, float>::const_iterator it = exptimes_map.begin(); it != exptimes_map.end(); ++it) {
+                        if (std::abs((it->first - from) / from) < 1e-5f) {
+                            if (to != 0)
+                                throw std::runtime_error("Internal error!");
+                            to = it->second;
+                        }
                     }
+                    if (to == 0)
+                        throw std::runtime_error((boost::format("Specified an exposure time replacement map, but couldn't find an entry for %1%") % from).str());
+
+                    cout << es.exposures[i].toString() << "->" << to;
+                    if (i+1 < es.exposures.size())
+                        cout << ", ";
+                    es.exposures[i].exposure = to;
                 }
-                if (to == 0)
-                    throw std::runtime_error((boost::format("Specified an exposure time replacement map, but couldn't find an entry for %1%") % from).str());
+                cout << "]" << endl;
+            }
 
-                cout << es.exposures[i].toString() << "->" << to;
-                if (i+1 < es.exposures.size())
-                    cout << ", ";
-                es.exposures[i].exposure = to;
+
+            if (vm.count("fitexptimes")) {
+                es.fitExposureTimes(vm["seed"].as<uint64_t>());
+                if (vm.count("exptimes"))
+                    cerr << "Note: you specified --exptimes and --fitexptimes at the same time. The" << endl
+                         << "The test file exptime_showfit.m now compares these two sets of exposure" << endl
+                         << "times, rather than the fit vs EXIF." << endl << endl;
             }
-            cout << "]" << endl;
+
+            /// Step 1: HDR merge
+            es.merge();
+        }
+
+        if (resumeStage == ECheckpointDemosaiced) {
+            if (rawOutput)
+                throw std::runtime_error("The merged Bayer grid ('raw' output) is not "
+                    "available when resuming from a demosaiced checkpoint!");
+            if (vm.count("grayscale") || vm.count("nodemosaic"))
+                throw std::runtime_error("--grayscale and --nodemosaic can't be used when "
+                    "resuming from a demosaiced checkpoint!");
         }
 
+        if (!checkpoint.empty() && checkpointStage == ECheckpointMerged) {
+            if (es.image_merged) {
+                es.writeCheckpoint(checkpoint, ECheckpointMerged);
+                checkpointWritten = true;
+            } else {
+                cerr << "Warning: the merged Bayer grid is not available when resuming from "
+                        "a demosaiced checkpoint. Ignoring --checkpoint.." << endl;
+            }
+        }
 
-        if (vm.count("fitexptimes")) {
-            es.fitExposureTimes();
-            if (vm.count("exptimes"))
-                cerr << "Note: you specified --exptimes and --fitexptimes at the same time. The" << endl
-                     << "The test file exptime_showfit.m now compares these two sets of exposure" << endl
-                     << "times, rather than the fit vs EXIF." << endl << endl;
+        /* Filter and target resolution used by the resampling step */
+        std::unique_ptr<ReconstructionFilter> rfilter;
+        std::string rfilterName = boost::to_lower_copy(vm["rfilter"].as<std::string>());
+        if (rfilterName == "lanczos") {
+            rfilter.reset(new LanczosSincFilter());
+        } else if (rfilterName == "tent") {
+            rfilter.reset(new TentFilter());
+        } else {
+            cout << "Invalid resampling filter chosen (must be 'lanczos' / 'tent')" << endl;
+            return -1;
         }
 
-        /// Step 1: HDR merge
-        es.merge();
+        auto resampleTarget = [&](size_t width, size_t height, int &w, int &h) {
+            if (resample.size() == 1) {
+                float factor = resample[0] / (float) std::max(width, height);
+                w = (int) std::round(factor * width);
+                h = (int) std::round(factor * height);
+            } else {
+                w = resample[0];
+                h = resample[1];
+            }
+        };
+
+        /* The merged Bayer grid, for outputs in the 'raw' format */
+        ImageView rawView = es.image();
 
         /// Step 3: Demosaicing
+        bool grayscale = vm.count("grayscale") != 0;
         bool demosaic = vm.count("nodemosaic") == 0;
-        if (demosaic)
-            es.demosaic(sensor2xyz);
+        if (grayscale && !demosaic) {
+            cerr << "Warning: --grayscale and --nodemosaic were specified at the same time. Ignoring --grayscale" << endl;
+            grayscale = false;
+        }
+        if (grayscale) {
+            demosaic = false;
+            es.luminance(sensor2xyz);
+        } else if (resumeStage == ECheckpointDemosaiced) {
+            /* Already done */
+        } else if (demosaic) {
+            /* When the output is much smaller than the sensor, downsample the color
+               planes of the Bayer grid to twice the target resolution instead of
+               demosaicing at full resolution. (Not possible when subsequent steps
+               refer to pixel coordinates of the full image or need full resolution,
+               and when the demosaiced image is saved as a checkpoint) */
+            int w = 0, h = 0;
+            if (!resample.empty())
+                resampleTarget(es.width, es.height, w, h);
+
+            if (!resample.empty() && crop.empty() && wbalpatch.empty() && !vm.count("vcal") &&
+                !vm.count("fulldemosaic") && !demosaicedCheckpoint &&
+                4*w <= (int) es.width && 4*h <= (int) es.height)
+                es.demosaicDownsampled(*rfilter, 2*w, 2*h);
+            else
+                es.demosaic(sensor2xyz);
+        }
+
+        if (demosaicedCheckpoint) {
+            es.writeCheckpoint(checkpoint, ECheckpointDemosaiced);
+            checkpointWritten = true;
+        }
+
+        /// Determine the vignetting correction (from --vcorr or the flat-field cache)
+        bool vcal = vm.count("vcal") != 0, vcorrected = false;
+        std::string flatcache = vm.count("flatcache") ? vm["flatcache"].as<std::string>() : "";
+        if (vcal && !vcorr.empty()) {
+            cerr << "Warning: only one of --vcal and --vcorr can be specified at a time. Ignoring --vcorr" << endl;
+            vcorr.clear();
+        }
+        if (!vcal && vcorr.empty() && !flatcache.empty()) {
+            float coeffs[3];
+            if (es.loadFlatField(flatcache, coeffs))
+                vcorr.assign(coeffs, coeffs + 3);
+        }
+        if ((vcal || !vcorr.empty()) && !demosaic && !grayscale) {
+            cerr << "Warning: Vignetting correction requires demosaicing. Ignoring.." << endl;
+            vcal = false;
+            vcorr.clear();
+        }
 
         /// Step 4: Transform colors
-        if (colormode != ENative) {
+        if (colormode != ENative && !grayscale) {
             if (!demosaic) {
                 cerr << "Warning: you requested XYZ/sRGB output, but demosaicing was explicitly disabled! " << endl
                      << "Color processing is not supported in this case -- writing raw sensor colors instead." << endl;
+            } else if (!vcorr.empty() && wbalpatch.empty()) {
+                /* All steps up to the vignetting correction are linear and per-pixel,
+                   hence the correction can be done in the same pass. (Not so when
+                   the white balance is estimated from a patch of the image.) */
+                GainMap gainmap(es.width, es.height, vcorr[0], vcorr[1], vcorr[2]);
+                es.transform_color(sensor2xyz, colormode == EXYZ, &gainmap);
+                vcorrected = true;
             } else {
                 es.transform_color(sensor2xyz, colormode == EXYZ);
             }
         }
 
         /// Step 5: White balancing
-        if (!wbal.empty()) {
+        if (!demosaic && (!wbal.empty() || !wbalpatch.empty())) {
+            cerr << "Warning: White balancing requires a demosaiced RGB image. Ignoring.." << endl;
+        } else if (!wbal.empty()) {
             float scale[3] = { wbal[0], wbal[1], wbal[2] };
             es.whitebalance(scale);
         } else if (wbalpatch.size()) {
@@ -409,106 +788,159 @@ int main(int argc, char **argv) {
             es.scale(scale);
 
         /// Step 7: Remove vignetting
-        if (vm.count("vcal")) {
-            if (vm.count("vcorr")) {
-                cerr << "Warning: only one of --vcal and --vcorr can be specified at a time. Ignoring --vcorr" << endl;
-            }
-
-            if (demosaic)
-                es.vcal();
-            else
-                cerr << "Warning: Vignetting correction requires demosaicing. Ignoring.." << endl;
-        } else if (!vcorr.empty()) {
-            if (demosaic)
-                es.vcorr(vcorr[0], vcorr[1], vcorr[2]);
-            else
-                cerr << "Warning: Vignetting correction requires demosaicing. Ignoring.." << endl;
+        if (vcal) {
+            float coeffs[3];
+            es.vcal(coeffs);
+            if (!flatcache.empty())
+                es.saveFlatField(flatcache, coeffs);
+        } else if (!vcorr.empty() && !vcorrected) {
+            es.vcorr(vcorr[0], vcorr[1], vcorr[2]);
         }
 
-        /// Step 8: Crop
-        if (!crop.empty())
-            es.crop(crop[0], crop[1], crop[2], crop[3]);
+        /* When resampling, steps 8-10 are done in a single pass */
+        bool warp = !resample.empty() && (demosaic || grayscale);
+        ERotateFlipType flipType = flipTypeFromString(
+            vm["rotate"].as<int>(), vm["flip"].as<std::string>());
 
-        /// Step 9: Resample
-        if (!resample.empty()) {
-            int w, h;
+        /// Step 8: Crop (without copying, by restricting the view of the image)
+        ImageView view = es.image();
+        if (!crop.empty() && !warp) {
+            cout << "Cropping to " << crop[2] << "x" << crop[3] << " .." << endl;
+            view = view.crop(crop[0], crop[1], crop[2], crop[3]);
+        }
 
-            if (resample.size() == 1) {
-                float factor = resample[0] / (float) std::max(es.width, es.height);
-                w = (int) std::round(factor * es.width);
-                h = (int) std::round(factor * es.height);
-            } else {
-                w = resample[0];
-                h = resample[1];
-            }
+        /// Step 9: Resample
+        if (warp) {
+            if (crop.empty())
+                crop = { 0, 0, (int) es.width, (int) es.height };
 
-            if (demosaic) {
-                std::string rfilter = boost::to_lower_copy(vm["rfilter"].as<std::string>());
-                if (rfilter == "lanczos") {
-                    es.resample(LanczosSincFilter(), w, h);
-                } else if (rfilter == "tent") {
-                    es.resample(TentFilter(), w, h);
-                } else {
-                    cout << "Invalid resampling filter chosen (must be 'lanczos' / 'tent')" << endl;
-                    return -1;
-                }
-            } else {
-                cout << "Warning: resampling a non-demosaiced image does not make much sense -- ignoring." << endl;
-            }
+            int w, h;
+            resampleTarget(crop[2], crop[3], w, h);
+            es.warp(*rfilter, crop[0], crop[1], crop[2], crop[3], w, h, flipType);
+            view = es.image();
+        } else if (!resample.empty()) {
+            cout << "Warning: resampling a non-demosaiced image does not make much sense -- ignoring." << endl;
         }
 
         /// Step 10: Flip / rotate
-        ERotateFlipType flipType = flipTypeFromString(
-            vm["rotate"].as<int>(), vm["flip"].as<std::string>());
-
-        if (flipType != ERotateNoneFlipNone) {
-            uint8_t *t_buf;
-            size_t t_width, t_height;
-
-            if (demosaic) {
-                rotateFlip((uint8_t *) es.image_demosaiced, es.width, es.height,
-                    t_buf, t_width, t_height, 3*sizeof(float), flipType);
-                delete[] es.image_demosaiced;
-                es.image_demosaiced = (float3 *) t_buf;
+        if (flipType != ERotateNoneFlipNone && !warp && (demosaic || grayscale)) {
+            if (flipType & 1) {
+                /* Rotations by 90 or 270 degrees require a copy */
+                uint8_t *t_buf;
+                size_t t_width, t_height;
+
+                rotateFlip((uint8_t *) view.data, view.width, view.height,
+                    t_buf, t_width, t_height, view.channels*sizeof(float), flipType,
+                    view.yStride*sizeof(float));
+
+                if (demosaic) {
+                    delete[] es.image_demosaiced;
+                    es.image_demosaiced = (float3 *) t_buf;
+                } else {
+                    delete[] es.image_luminance;
+                    es.image_luminance = (float *) t_buf;
+                }
                 es.width = t_width;
                 es.height = t_height;
+                view = es.image();
+            } else {
+                /* Flips only change the strides of the view */
+                view = view.flip(flipType);
             }
         }
 
         /// Step 11: Write output
-        std::string output = vm["output"].as<std::string>();
-        std::string format = boost::to_lower_copy(vm["format"].as<std::string>());
-
-        if (vm["output"].defaulted() && exposures.size() == 1 && exposures[0].find("%") == std::string::npos) {
-            std::string fname = exposures[0];
-            size_t spos = fname.find_last_of(".");
-            if (spos != std::string::npos)
-                output = fname.substr(0, spos) + ".exr";
+        if (!previews.empty() && (!demosaic || grayscale))
+            throw std::runtime_error("--previews is only supported for color output!");
+
+        EXROptions exrOptions;
+        exrOptions.compression = vm["exr-compression"].as<EEXRCompression>();
+        exrOptions.levels = vm["exr-levels"].as<EEXRLevels>();
+        exrOptions.lineOrder = vm["exr-lineorder"].as<EEXRLineOrder>();
+        exrOptions.profile = vm.count("profile") > 0;
+        if (!exrTiles.empty()) {
+            if (exrTiles[0] <= 0 || exrTiles[exrTiles.size()-1] <= 0)
+                throw std::runtime_error("--exr-tiles: the tile size must be positive!");
+            exrOptions.tileWidth = exrTiles[0];
+            exrOptions.tileHeight = exrTiles[exrTiles.size()-1];
         }
 
-        if (format == "jpg")
-            format = "jpeg";
+        JPEGOptions jpegOptions;
+        jpegOptions.exposure = vm["jpeg-exposure"].as<float>();
+        jpegOptions.toneCurve = vm["jpeg-tonecurve"].as<EToneCurve>();
 
-        if (format == "jpeg" && boost::ends_with(output,  ".exr"))
-            output = output.substr(0, output.length()-4) + ".jpg";
+        if (!demosaic && !grayscale)
+            rawView = view;
 
-        if (demosaic) {
-            if (format == "half" || format == "single")
-                writeOpenEXR(output, es.width, es.height, 3,
-                    (float *) es.image_demosaiced, es.metadata, format == "half");
-            else if (format == "jpeg")
-                writeJPEG(output, es.width, es.height, (float *) es.image_demosaiced);
-            else
-                throw std::runtime_error("Unsupported --format argument");
-        } else {
-            if (format == "half" || format == "single")
-                writeOpenEXR(output, es.width, es.height, 1,
-                    (float *) es.image_merged, es.metadata, format == "half");
-            else if (format == "jpeg")
+        for (size_t i=0; i<outputs.size(); ++i) {
+            if (outputs[i].second != "jpeg")
+                continue;
+            if (grayscale)
+                throw std::runtime_error("Grayscale output is currently only supported "
+                    "in OpenEXR format.");
+            else if (!demosaic)
                 throw std::runtime_error("Tried to export the raw Bayer grid "
                     "as a JPEG image -- this is not allowed.");
+        }
+
+        /* All outputs are written from the same in-memory state. Multiple outputs
+           are written in parallel (OpenEXR and libjpeg don't share any state) */
+        auto write = [&](const std::string &output, const std::string &format) {
+            if (format == "half" || format == "single")
+                writeOpenEXR(output, view, es.metadata, format == "half", exrOptions);
+            else if (format == "pfm")
+                writePFM(output, view);
+            else if (format == "rawf32")
+                writeRawFloat(output, view, es.metadata);
+            else if (format == "raw" && boost::ends_with(output, ".pfm"))
+                writePFM(output, rawView);
+            else if (format == "raw" && boost::ends_with(output, ".f32"))
+                writeRawFloat(output, rawView, es.metadata);
+            else if (format == "raw")
+                writeOpenEXR(output, rawView, es.metadata, defaultFormat != "single", exrOptions);
             else
-                throw std::runtime_error("Unsupported --format argument");
+                writeJPEG(output, view, jpegOptions);
+        };
+
+        if (outputs.size() == 1) {
+            write(outputs[0].first, outputs[0].second);
+        } else {
+            std::vector<std::future<void>> writers;
+            for (size_t i=0; i<outputs.size(); ++i)
+                writers.push_back(std::async(std::launch::async, write,
+                    outputs[i].first, outputs[i].second));
+            for (size_t i=0; i<writers.size(); ++i)
+                writers[i].get();
+        }
+
+        std::vector<std::string> previewFiles;
+        if (!previews.empty()) {
+            /* Downscale from the in-memory image rather than reading the output back */
+            const std::string &output = outputs[0].first;
+            size_t spos = output.find_last_of(".");
+            JPEGOptions previewOptions = jpegOptions;
+            previewOptions.quality = 90;
+            previewFiles = writePreviews(spos != std::string::npos ? output.substr(0, spos) : output,
+                view, previews, previewOptions);
+        }
+
+        if (cache) {
+            std::vector<std::string> files;
+            for (size_t i=0; i<outputs.size(); ++i) {
+                files.push_back(outputs[i].first);
+                if (outputs[i].second == "rawf32" || (outputs[i].second == "raw" &&
+                        boost::ends_with(outputs[i].first, ".f32")))
+                    files.push_back(outputs[i].first + ".json");
+            }
+            files.insert(files.end(), previewFiles.begin(), previewFiles.end());
+            if (vm.count("stats") && !resume)
+                files.push_back(vm["stats"].as<std::string>());
+            if (checkpointWritten)
+                files.push_back(checkpoint);
+
+            cache->store(cacheKey, files);
+            if (vm.count("cache-stats"))
+                cache->printStatistics();
         }
     } catch (const std::exception &ex) {
         cerr << "Encountered a fatal error: " << ex.what() << endl;
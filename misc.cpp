@@ -30,10 +30,45 @@ ERotateFlipType flipTypeFromString(int rotation, std::string axes) {
         "0, 90, 180 or 270, and the argument to --flip must be one of x, y, or xy");
 }
 
+/// Fixed-size pixel (lets the compiler turn each pixel copy into a few moves)
+template <size_t N> struct Pixel {
+    uint8_t data[N];
+};
+
+/**
+ * Rotate/flip kernel for a fixed pixel size. The target is traversed in
+ * square tiles (in parallel), so that a tile's source rows remain in the
+ * cache while the tile is filled in -- a 90 degree rotation would otherwise
+ * touch a new cache line (and often a new page) for every single pixel.
+ */
+template <size_t N> static void rotateFlipBlocked(const uint8_t *src,
+        ptrdiff_t src_x_step, ptrdiff_t src_y_step,
+        uint8_t *dst, size_t t_width, size_t t_height) {
+    const size_t tileSize = 32;
+    size_t tilesX = (t_width + tileSize - 1) / tileSize,
+           tilesY = (t_height + tileSize - 1) / tileSize;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int tile=0; tile<(int) (tilesX*tilesY); ++tile) {
+        size_t x0 = (tile % tilesX) * tileSize, x1 = std::min(x0 + tileSize, t_width),
+               y0 = (tile / tilesX) * tileSize, y1 = std::min(y0 + tileSize, t_height);
+
+        for (size_t y=y0; y<y1; ++y) {
+            const uint8_t *src_pixel = src + (ptrdiff_t) y * src_y_step + (ptrdiff_t) x0 * src_x_step;
+            Pixel<N> *dst_pixel = (Pixel<N> *) dst + y * t_width + x0;
+
+            for (size_t x=x0; x<x1; ++x) {
+                *dst_pixel++ = *(const Pixel<N> *) src_pixel;
+                src_pixel += src_x_step;
+            }
+        }
+    }
+}
+
 void rotateFlip(
         uint8_t *src,  size_t  s_width, size_t  s_height,
         uint8_t *&dst, size_t &t_width, size_t &t_height,
-        int bypp, ERotateFlipType type) {
+        int bypp, ERotateFlipType type, size_t s_stride) {
     bool rotate_90 = type&1;
 
     bool flip_x = (type & 6) == 2 || (type & 6) == 4;
@@ -44,8 +79,8 @@ void rotateFlip(
     if (rotate_90)
         std::swap(t_width, t_height);
 
-    int src_stride = s_width * bypp,
-        dst_stride = t_width * bypp;
+    ptrdiff_t src_stride = s_stride ? s_stride : s_width * bypp,
+              dst_stride = t_width * bypp;
 
     dst = new uint8_t[t_width*t_height*bypp];
 
@@ -56,7 +91,7 @@ void rotateFlip(
     if (flip_y)
         src_row += src_stride * (s_height - 1);
 
-    int src_x_step, src_y_step;
+    ptrdiff_t src_x_step, src_y_step;
     if (rotate_90) {
         src_x_step = flip_y ? -src_stride : src_stride;
         src_y_step = flip_x ? -bypp : bypp;
@@ -65,6 +100,13 @@ void rotateFlip(
         src_y_step = flip_y ? -src_stride : src_stride;
     }
 
+    /* Specialized kernels for RGB/grayscale float and 16 bit images */
+    switch (bypp) {
+        case 12: rotateFlipBlocked<12>(src_row, src_x_step, src_y_step, dst, t_width, t_height); return;
+        case 4:  rotateFlipBlocked<4> (src_row, src_x_step, src_y_step, dst, t_width, t_height); return;
+        case 2:  rotateFlipBlocked<2> (src_row, src_x_step, src_y_step, dst, t_width, t_height); return;
+    }
+
     for (size_t y=0; y<t_height; y++) {
         uint8_t *src_pixel = src_row;
         uint8_t *dst_pixel = dst_row;
@@ -96,6 +138,96 @@ std::istream& operator>>(std::istream& in, EColorMode& unit) {
     return in;
 }
 
+std::istream& operator>>(std::istream& in, EEXRCompression& unit) {
+    std::string token;
+    in >> token;
+    std::string token_lc = boost::to_lower_copy(token);
+
+    if (token_lc == "none")
+        unit = EEXRNone;
+    else if (token_lc == "rle")
+        unit = EEXRRLE;
+    else if (token_lc == "zips")
+        unit = EEXRZIPS;
+    else if (token_lc == "zip")
+        unit = EEXRZIP;
+    else if (token_lc == "piz")
+        unit = EEXRPIZ;
+    else if (token_lc == "pxr24")
+        unit = EEXRPXR24;
+    else if (token_lc == "b44")
+        unit = EEXRB44;
+    else if (token_lc == "dwaa")
+        unit = EEXRDWAA;
+    else if (token_lc == "dwab")
+        unit = EEXRDWAB;
+    else
+        throw po::validation_error(po::validation_error::invalid_option_value, "exr-compression", token);
+    return in;
+}
+
+std::istream& operator>>(std::istream& in, EEXRLevels& unit) {
+    std::string token;
+    in >> token;
+    std::string token_lc = boost::to_lower_copy(token);
+
+    if (token_lc == "one")
+        unit = EEXROneLevel;
+    else if (token_lc == "mipmap")
+        unit = EEXRMipmap;
+    else if (token_lc == "ripmap")
+        unit = EEXRRipmap;
+    else
+        throw po::validation_error(po::validation_error::invalid_option_value, "exr-levels", token);
+    return in;
+}
+
+std::istream& operator>>(std::istream& in, EEXRLineOrder& unit) {
+    std::string token;
+    in >> token;
+    std::string token_lc = boost::to_lower_copy(token);
+
+    if (token_lc == "increasing")
+        unit = EEXRIncreasingY;
+    else if (token_lc == "decreasing")
+        unit = EEXRDecreasingY;
+    else if (token_lc == "random")
+        unit = EEXRRandomY;
+    else
+        throw po::validation_error(po::validation_error::invalid_option_value, "exr-lineorder", token);
+    return in;
+}
+
+std::istream& operator>>(std::istream& in, EToneCurve& unit) {
+    std::string token;
+    in >> token;
+    std::string token_lc = boost::to_lower_copy(token);
+
+    if (token_lc == "linear")
+        unit = ELinearTone;
+    else if (token_lc == "reinhard")
+        unit = EReinhardTone;
+    else if (token_lc == "filmic")
+        unit = EFilmicTone;
+    else
+        throw po::validation_error(po::validation_error::invalid_option_value, "jpeg-tonecurve", token);
+    return in;
+}
+
+std::istream& operator>>(std::istream& in, ECheckpointStage& unit) {
+    std::string token;
+    in >> token;
+    std::string token_lc = boost::to_lower_copy(token);
+
+    if (token_lc == "merged")
+        unit = ECheckpointMerged;
+    else if (token_lc == "demosaiced")
+        unit = ECheckpointDemosaiced;
+    else
+        throw po::validation_error(po::validation_error::invalid_option_value, "checkpoint-stage", token);
+    return in;
+}
+
 int getProcessorCount() {
     return std::thread::hardware_concurrency();
 }
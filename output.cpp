@@ -1,8 +1,30 @@
 #include "hdrmerge.h"
 
 #include <boost/format.hpp>
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <fstream>
+#include <future>
+#include <mutex>
 
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HDRMERGE_SSE2 1
+#endif
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <OpenEXRConfig.h>
 #include <ImfOutputFile.h>
+#include <ImfTiledOutputFile.h>
 #include <ImfChannelList.h>
 #include <ImfStringAttribute.h>
 
@@ -11,79 +33,251 @@ extern "C" {
     #include <jerror.h>
 };
 
-void writeOpenEXR(const std::string &filename, size_t w, size_t h, int nChannels, float *data, const StringMap &metadata, bool writeHalf) {
-    Imf::setGlobalThreadCount(getProcessorCount());
+namespace fs = boost::filesystem;
+
+/// Convert a contiguous array of floats to half precision
+static void floatToHalf(const float *src, half *dst, size_t count) {
+    size_t i = 0;
+    #if defined(__F16C__)
+        /* Convert eight values at a time (rounding to the nearest even value like 'half') */
+        for (; i+8 <= count; i += 8)
+            _mm_storeu_si128((__m128i *) (dst + i),
+                _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+    #endif
+    for (; i<count; ++i)
+        dst[i] = src[i];
+}
+
+/// Convert the rows [y0, y1) of an image to densely packed half precision values (in parallel)
+static void convertToHalf(const ImageView &image, size_t y0, size_t y1, half *buffer) {
+    const size_t rowSize = image.width * image.channels;
+
+    #pragma omp parallel for
+    for (int y=(int) y0; y<(int) y1; ++y) {
+        half *dst = buffer + (y - y0) * rowSize;
+        if (image.xStride == image.channels) {
+            floatToHalf(image.pixel(0, y), dst, rowSize);
+        } else {
+            for (size_t x=0; x<image.width; ++x) {
+                const float *pixel = image.pixel(x, y);
+                for (int c=0; c<image.channels; ++c)
+                    *dst++ = pixel[c];
+            }
+        }
+    }
+}
+
+/// Translate the compression setting into the OpenEXR enumeration
+static Imf::Compression exrCompression(EEXRCompression compression) {
+    switch (compression) {
+        case EEXRNone: return Imf::NO_COMPRESSION;
+        case EEXRRLE: return Imf::RLE_COMPRESSION;
+        case EEXRZIPS: return Imf::ZIPS_COMPRESSION;
+        case EEXRZIP: return Imf::ZIP_COMPRESSION;
+        case EEXRPIZ: return Imf::PIZ_COMPRESSION;
+        case EEXRPXR24: return Imf::PXR24_COMPRESSION;
+        case EEXRB44: return Imf::B44_COMPRESSION;
+#if defined(OPENEXR_VERSION_MAJOR) && (OPENEXR_VERSION_MAJOR > 2 || \
+    (OPENEXR_VERSION_MAJOR == 2 && OPENEXR_VERSION_MINOR >= 2))
+        case EEXRDWAA: return Imf::DWAA_COMPRESSION;
+        case EEXRDWAB: return Imf::DWAB_COMPRESSION;
+#else
+        case EEXRDWAA:
+        case EEXRDWAB:
+            throw std::runtime_error("writeOpenEXR(): DWA compression requires OpenEXR 2.2 or newer!");
+#endif
+        default:
+            throw std::runtime_error("writeOpenEXR(): unknown compression type!");
+    }
+}
+
+/// Write all tiles of one resolution level of a tiled OpenEXR file
+static void writeLevel(Imf::TiledOutputFile &file, const ImageView &image,
+        const char **names, bool writeHalf, int lx, int ly) {
+    int nChannels = image.channels;
+    Imf::FrameBuffer frameBuffer;
+    std::vector<half> buffer;
+
+    if (writeHalf) {
+        size_t rowSize = image.width * nChannels;
+        buffer.resize(rowSize * image.height);
+        convertToHalf(image, 0, image.height, buffer.data());
+        for (int c=0; c<nChannels; ++c)
+            frameBuffer.insert(names[c], Imf::Slice(Imf::HALF, (char *) (buffer.data() + c),
+                sizeof(half) * nChannels, sizeof(half) * rowSize));
+    } else {
+        for (int c=0; c<nChannels; ++c)
+            frameBuffer.insert(names[c], Imf::Slice(Imf::FLOAT, (char *) (image.data + c),
+                (size_t) (image.xStride * (ptrdiff_t) sizeof(float)),
+                (size_t) (image.yStride * (ptrdiff_t) sizeof(float))));
+    }
+
+    file.setFrameBuffer(frameBuffer);
+    file.writeTiles(0, file.numXTiles(lx) - 1, 0, file.numYTiles(ly) - 1, lx, ly);
+}
+
+/**
+ * Write a tiled OpenEXR file. The lower resolution levels of mipmapped or
+ * ripmapped files are generated with a cascade of 2x box filter reductions,
+ * so that each level is computed from the next-larger one
+ */
+static void writeTiledOpenEXR(const std::string &filename, Imf::Header &header,
+        const ImageView &image, const char **names, bool writeHalf, EEXRLevels levels) {
+    Imf::TiledOutputFile file(filename.c_str(), header);
+    BoxFilter box;
+
+    if (levels == EEXROneLevel) {
+        writeLevel(file, image, names, writeHalf, 0, 0);
+    } else if (levels == EEXRMipmap) {
+        ImageView level = image;
+        std::unique_ptr<float[]> data;
+        for (int l=0; l<file.numLevels(); ++l) {
+            if (l > 0) {
+                data.reset(resampleImage(box, level, file.levelWidth(l), file.levelHeight(l)));
+                level = ImageView(data.get(), file.levelWidth(l), file.levelHeight(l), image.channels);
+            }
+            writeLevel(file, level, names, writeHalf, l, l);
+        }
+    } else {
+        /* Ripmap: reduce the height along the first column of levels, and the width along each row */
+        ImageView column = image;
+        std::unique_ptr<float[]> columnData;
+        for (int ly=0; ly<file.numYLevels(); ++ly) {
+            if (ly > 0) {
+                columnData.reset(resampleImage(box, column, column.width, file.levelHeight(ly)));
+                column = ImageView(columnData.get(), column.width, file.levelHeight(ly), image.channels);
+            }
+
+            ImageView level = column;
+            std::unique_ptr<float[]> data;
+            for (int lx=0; lx<file.numXLevels(); ++lx) {
+                if (lx > 0) {
+                    data.reset(resampleImage(box, level, file.levelWidth(lx), level.height));
+                    level = ImageView(data.get(), file.levelWidth(lx), level.height, image.channels);
+                }
+                writeLevel(file, level, names, writeHalf, lx, ly);
+            }
+        }
+    }
+}
+
+void writeOpenEXR(const std::string &filename, const ImageView &image, const StringMap &metadata,
+        bool writeHalf, const EXROptions &options) {
+    /* Only set up the thread pool once (several files may be written concurrently) */
+    static std::once_flag threadPoolFlag;
+    std::call_once(threadPoolFlag, []() { Imf::setGlobalThreadCount(getProcessorCount()); });
+
+    size_t w = image.width, h = image.height;
+    int nChannels = image.channels;
 
     Imf::Header header(w, h);
     for (StringMap::const_iterator it = metadata.begin(); it != metadata.end(); ++it)
         header.insert(it->first.c_str(), Imf::StringAttribute(it->second.c_str()));
 
+    header.compression() = exrCompression(options.compression);
+
+    bool tiled = options.tileWidth > 0 || options.levels != EEXROneLevel;
+    if (tiled) {
+        static const Imf::LevelMode levelModes[] = {
+            Imf::ONE_LEVEL, Imf::MIPMAP_LEVELS, Imf::RIPMAP_LEVELS };
+        int tileWidth = options.tileWidth > 0 ? options.tileWidth : 64,
+            tileHeight = options.tileHeight > 0 ? options.tileHeight : tileWidth;
+        header.setTileDescription(Imf::TileDescription(tileWidth, tileHeight,
+            levelModes[options.levels]));
+    } else if (options.lineOrder == EEXRRandomY) {
+        throw std::runtime_error("writeOpenEXR(): the random line order is only supported by tiled files!");
+    }
+
+    static const Imf::LineOrder lineOrders[] = {
+        Imf::INCREASING_Y, Imf::DECREASING_Y, Imf::RANDOM_Y };
+    header.lineOrder() = lineOrders[options.lineOrder];
+
     Imf::ChannelList &channels = header.channels();
 
+    static const char *rgbNames[] = { "R", "G", "B" }, *yNames[] = { "Y" };
+    const char **names;
+    if (nChannels == 3)
+        names = rgbNames;
+    else if (nChannels == 1)
+        names = yNames;
+    else
+        throw std::runtime_error("writeOpenEXR(): unknown number of channels!");
+
     cout << "Writing " << filename << " (" << w << "x" << h << ", " << nChannels
          << " channels, " << (writeHalf ? "half" : "single") << " precision) .. " << endl;
-    if (nChannels == 3) {
-        if (writeHalf) {
-            channels.insert("R", Imf::Channel(Imf::HALF));
-            channels.insert("G", Imf::Channel(Imf::HALF));
-            channels.insert("B", Imf::Channel(Imf::HALF));
-
-            /* Though it would be nicer to do the conversion scanline by scanline,
-               this would prevent us from using OpenEXR's multithreading abilities.
-               Hence, convert everything at once with a full-sized buffer */
-            half *buffer = new half[3*w*h];
-            for (size_t j=0; j<3*w*h; ++j)
-                buffer[j] = *data++;
 
-            Imf::FrameBuffer frameBuffer;
-            frameBuffer.insert("R", Imf::Slice(Imf::HALF, (char *) buffer,   6, 6*w));
-            frameBuffer.insert("G", Imf::Slice(Imf::HALF, (char *) buffer+2, 6, 6*w));
-            frameBuffer.insert("B", Imf::Slice(Imf::HALF, (char *) buffer+4, 6, 6*w));
+    for (int c=0; c<nChannels; ++c)
+        channels.insert(names[c], Imf::Channel(writeHalf ? Imf::HALF : Imf::FLOAT));
 
-            Imf::OutputFile file(filename.c_str(), header);
-            file.setFrameBuffer(frameBuffer);
-            file.writePixels(h);
-            delete[] buffer;
-        } else {
-            channels.insert("R", Imf::Channel(Imf::FLOAT));
-            channels.insert("G", Imf::Channel(Imf::FLOAT));
-            channels.insert("B", Imf::Channel(Imf::FLOAT));
-            Imf::FrameBuffer frameBuffer;
-            frameBuffer.insert("R", Imf::Slice(Imf::FLOAT, (char *) data,   12, 12*w));
-            frameBuffer.insert("G", Imf::Slice(Imf::FLOAT, (char *) data+4, 12, 12*w));
-            frameBuffer.insert("B", Imf::Slice(Imf::FLOAT, (char *) data+8, 12, 12*w));
-            Imf::OutputFile file(filename.c_str(), header);
-            file.setFrameBuffer(frameBuffer);
-            file.writePixels(h);
-        }
-    } else if (nChannels == 1) {
-        if (writeHalf) {
-            channels.insert("Y", Imf::Channel(Imf::HALF));
+    auto start = std::chrono::steady_clock::now();
 
-            /* Though it would be nicer to do the conversion scanline by scanline,
-               this would prevent us from using OpenEXR's multithreading abilities.
-               Hence, convert everything at once with a full-sized buffer */
-            half *buffer = new half[w*h];
-            for (size_t j=0; j<w*h; ++j)
-                buffer[j] = *data++;
+    if (tiled) {
+        writeTiledOpenEXR(filename, header, image, names, writeHalf, options.levels);
+    } else if (writeHalf) {
+        Imf::OutputFile file(filename.c_str(), header);
 
-            Imf::FrameBuffer frameBuffer;
-            frameBuffer.insert("Y", Imf::Slice(Imf::HALF, (char *) buffer,   2, 2*w));
+        /* Convert and write the image in chunks of scanlines: the conversion of
+           the next chunk overlaps with the compression of the current one by
+           OpenEXR's thread pool, and no full-sized half precision copy is needed.
+           Files with a decreasing line order are written bottom to top */
+        size_t chunkSize = std::max((size_t) 64, (size_t) 32 * getProcessorCount());
+        size_t rowSize = nChannels * w, nChunks = (h + chunkSize - 1) / chunkSize;
+        bool decreasing = options.lineOrder == EEXRDecreasingY;
+        /* Declared before the futures below, so that a pending conversion never outlives them */
+        std::vector<half> buffers[2] = {
+            std::vector<half>(chunkSize * rowSize), std::vector<half>(chunkSize * rowSize) };
 
-            Imf::OutputFile file(filename.c_str(), header);
-            file.setFrameBuffer(frameBuffer);
-            file.writePixels(h);
-            delete[] buffer;
-        } else {
-            channels.insert("Y", Imf::Channel(Imf::FLOAT));
+        auto chunkStart = [&](size_t chunk) -> size_t {
+            return (decreasing ? nChunks - 1 - chunk : chunk) * chunkSize;
+        };
+
+        convertToHalf(image, chunkStart(0), std::min(chunkStart(0) + chunkSize, h), buffers[0].data());
+        for (size_t chunk=0; chunk<nChunks; ++chunk) {
+            size_t y0 = chunkStart(chunk), y1 = std::min(y0 + chunkSize, h);
+            half *buffer = buffers[chunk % 2].data();
+
+            std::future<void> next;
+            if (chunk + 1 < nChunks) {
+                size_t next0 = chunkStart(chunk + 1);
+                next = std::async(std::launch::async, convertToHalf, std::cref(image),
+                    next0, std::min(next0 + chunkSize, h), buffers[(chunk + 1) % 2].data());
+            }
+
+            /* The slices are addressed using absolute scanline numbers */
+            char *base = (char *) buffer - y0 * rowSize * sizeof(half);
             Imf::FrameBuffer frameBuffer;
-            frameBuffer.insert("Y", Imf::Slice(Imf::FLOAT, (char *) data,   4, 4*w));
-            Imf::OutputFile file(filename.c_str(), header);
+            for (int c=0; c<nChannels; ++c)
+                frameBuffer.insert(names[c], Imf::Slice(Imf::HALF, base + c * sizeof(half),
+                    sizeof(half) * nChannels, sizeof(half) * rowSize));
+
             file.setFrameBuffer(frameBuffer);
-            file.writePixels(h);
+            file.writePixels((int) (y1 - y0));
+
+            if (next.valid())
+                next.get();
         }
     } else {
-        throw std::runtime_error("writeOpenEXR(): unknown number of channels!");
+        /* Hand the strides of the view to OpenEXR, so that cropped or flipped
+           images are written without a copy. (Negative strides wrap around as
+           unsigned values, which still produces the right addresses) */
+        Imf::FrameBuffer frameBuffer;
+        for (int c=0; c<nChannels; ++c)
+            frameBuffer.insert(names[c], Imf::Slice(Imf::FLOAT, (char *) (image.data + c),
+                (size_t) (image.xStride * (ptrdiff_t) sizeof(float)),
+                (size_t) (image.yStride * (ptrdiff_t) sizeof(float))));
+
+        Imf::OutputFile file(filename.c_str(), header);
+        file.setFrameBuffer(frameBuffer);
+        file.writePixels(h);
+    }
+
+    if (options.profile) {
+        double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        double size = (double) (w * h * nChannels * (writeHalf ? sizeof(half) : sizeof(float))),
+               fileSize = (double) fs::file_size(filename);
+        cout << boost::format("OpenEXR profile: %.1f MiB in %.3f s (%.1f MiB/s), compression ratio %.2f")
+            % (size / (1024*1024)) % seconds % (size / (1024*1024) / seconds) % (size / fileSize) << endl;
     }
 }
 
@@ -95,21 +289,138 @@ extern "C" {
     }
 };
 
-void writeJPEG(const std::string &filename, size_t w, size_t h, float *data, int quality) {
+/**
+ * Lookup table that maps linear values to 8 bit sRGB (including the tone
+ * curve). It is indexed by the upper bits of the IEEE 754 representation of
+ * the input, which gives each octave in [2^-13, 2^16] the same number of
+ * entries (1024). Smaller values all encode to zero.
+ */
+class SRGBTable {
+public:
+    SRGBTable(EToneCurve toneCurve) {
+        m_table.resize(((maxBits - minBits) >> shift) + 1);
+
+        for (size_t i=0; i<m_table.size(); ++i) {
+            /* Evaluate at the center of the interval covered by each entry */
+            uint32_t bits = minBits + (uint32_t) (i << shift) + (1u << (shift-1));
+            if (bits > maxBits)
+                bits = maxBits;
+            float value;
+            memcpy(&value, &bits, sizeof(float));
+
+            if (toneCurve == EReinhardTone) {
+                value = value / (1.0f + value);
+            } else if (toneCurve == EFilmicTone) {
+                /* Fit of the ACES reference rendering transform by K. Narkowicz */
+                value = (value * (2.51f * value + 0.03f)) / (value * (2.43f * value + 0.59f) + 0.14f);
+            }
+
+            value = std::min(value, 1.0f);
+            if (value <= 0.0031308f)
+                value = 12.92f * value;
+            else
+                value = 1.055f * std::pow(value, 1.0f/2.4f) - 0.055f;
+
+            m_table[i] = (uint8_t) std::max(std::min(255.0f, std::round(value * 255.0f)), 0.0f);
+        }
+    }
+
+    /// Encode 'count' values (scaled by 'scale') from 'src' to 'dst'
+    void encode(const float *src, uint8_t *dst, size_t count, float scale) const {
+        const uint8_t *table = &m_table[0];
+        size_t i = 0;
+
+        #if defined(HDRMERGE_SSE2)
+            const __m128 vscale = _mm_set1_ps(scale), vmin = _mm_set1_ps(minValue()),
+                         vmax = _mm_set1_ps(maxValue());
+            const __m128i vminBits = _mm_set1_epi32((int) minBits);
+
+            for (; i+4 <= count; i += 4) {
+                /* Clamp to the table range (the operand order maps NaNs to the minimum) */
+                __m128 value = _mm_mul_ps(_mm_loadu_ps(src + i), vscale);
+                value = _mm_min_ps(_mm_max_ps(value, vmin), vmax);
+                __m128i index = _mm_srli_epi32(
+                    _mm_sub_epi32(_mm_castps_si128(value), vminBits), shift);
+
+                uint32_t idx[4];
+                _mm_storeu_si128((__m128i *) idx, index);
+                dst[i]   = table[idx[0]];
+                dst[i+1] = table[idx[1]];
+                dst[i+2] = table[idx[2]];
+                dst[i+3] = table[idx[3]];
+            }
+        #endif
+
+        for (; i<count; ++i) {
+            float value = src[i] * scale;
+            value = value > minValue() ? value : minValue();
+            value = value < maxValue() ? value : maxValue();
+
+            uint32_t bits;
+            memcpy(&bits, &value, sizeof(float));
+            dst[i] = table[(bits - minBits) >> shift];
+        }
+    }
+
+private:
+    static const uint32_t minBits = 0x39000000u; /* 2^-13 */
+    static const uint32_t maxBits = 0x47800000u; /* 2^16 */
+    static const int shift = 13;
+
+    static float minValue() { return 1.0f / 8192.0f; }
+    static float maxValue() { return 65536.0f; }
+
+    std::vector<uint8_t> m_table;
+};
+
+/// Encode the rows [y0, y1) of an image to densely packed 8 bit sRGB values (in parallel)
+static void convertToSRGB(const SRGBTable &table, const ImageView &image, float scale,
+        size_t y0, size_t y1, uint8_t *buffer) {
+    const size_t rowSize = image.width * 3;
+
+    #pragma omp parallel
+    {
+        std::vector<float> row(image.xStride == 3 ? 0 : rowSize);
+
+        #pragma omp for
+        for (int y=(int) y0; y<(int) y1; ++y) {
+            const float *src = image.pixel(0, y);
+            if (image.xStride != 3) {
+                for (size_t x=0; x<image.width; ++x)
+                    memcpy(&row[3*x], image.pixel(x, y), 3 * sizeof(float));
+                src = &row[0];
+            }
+            table.encode(src, buffer + (y - y0) * rowSize, rowSize, scale);
+        }
+    }
+}
+
+void writeJPEG(const std::string &filename, const ImageView &image, const JPEGOptions &options) {
+    if (image.channels != 3)
+        throw std::runtime_error("writeJPEG(): only RGB images are supported!");
+
+    size_t w = image.width, h = image.height;
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
 
-    FILE *file = fopen(filename.c_str(), "w");
-    if (!file)
+    std::unique_ptr<FILE, int (*)(FILE *)> handle(fopen(filename.c_str(), "wb"), fclose);
+    if (!handle)
         throw std::runtime_error("Unable to open output file");
 
     cout << "Writing " << filename << " (" << w << "x" << h << ", "
          << "3 channels, low dynamic range) .. " << endl;
 
+    /* Releases the libjpeg data structures (also when libjpeg or the conversion throws) */
+    struct CompressGuard {
+        jpeg_compress_struct *cinfo;
+        ~CompressGuard() { jpeg_destroy_compress(cinfo); }
+    };
+
     cinfo.err = jpeg_std_error(&jerr);
     jerr.error_exit = jpeg_error_exit;
     jpeg_create_compress(&cinfo);
-    jpeg_stdio_dest(&cinfo, file);
+    CompressGuard guard = { &cinfo };
+    jpeg_stdio_dest(&cinfo, handle.get());
 
     cinfo.image_width = (int) w;
     cinfo.image_height = (int) h;
@@ -117,35 +428,280 @@ void writeJPEG(const std::string &filename, size_t w, size_t h, float *data, int
     cinfo.in_color_space = JCS_RGB;
 
     jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_set_quality(&cinfo, options.quality, TRUE);
     jpeg_start_compress(&cinfo, TRUE);
 
-    uint8_t *buffer = new uint8_t[w * h * 3];
-    uint8_t **scanlines = new uint8_t*[h];
+    SRGBTable table(options.toneCurve);
+    float scale = std::pow(2.0f, options.exposure);
 
-    #pragma omp parallel for
-    for (int i=0; i<h; ++i) {
-        float *in_ptr = data + w * i * 3;
-        uint8_t *out_ptr = buffer + w * i * 3;
-        scanlines[i] = out_ptr;
+    /* Encode and compress the image in bands of scanlines: the conversion
+       of the next band overlaps with the compression of the current one */
+    size_t bandSize = 64, rowSize = 3 * w;
+    std::vector<uint8_t> buffers[2] = {
+        std::vector<uint8_t>(bandSize * rowSize), std::vector<uint8_t>(bandSize * rowSize) };
+    std::vector<JSAMPROW> scanlines(bandSize);
 
-        for (int j=0; j<3*w; ++j) {
-            float value = *in_ptr++;
-            if (value <= 0.0031308f)
-                value = 12.92f * value;
-            else
-                value = 1.055f * std::pow(value, 1.0f/2.4f) - 0.055f;
+    convertToSRGB(table, image, scale, 0, std::min(bandSize, h), buffers[0].data());
+    for (size_t y0=0, band=0; y0<h; y0 += bandSize, ++band) {
+        size_t y1 = std::min(y0 + bandSize, h);
+        uint8_t *buffer = buffers[band % 2].data();
 
-            *out_ptr ++ = (uint8_t) std::max(std::min(255.0f, std::round(value * 255.0f)), 0.0f);
-        }
+        std::future<void> next;
+        if (y1 < h)
+            next = std::async(std::launch::async, convertToSRGB, std::cref(table), std::cref(image),
+                scale, y1, std::min(y1 + bandSize, h), buffers[(band + 1) % 2].data());
+
+        for (size_t y=y0; y<y1; ++y)
+            scanlines[y - y0] = buffer + (y - y0) * rowSize;
+        jpeg_write_scanlines(&cinfo, &scanlines[0], (JDIMENSION) (y1 - y0));
+
+        if (next.valid())
+            next.get();
     }
-    jpeg_write_scanlines(&cinfo, scanlines, (int) h);
 
-    /* Release the libjpeg data structures */
     jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
-    delete[] buffer;
-    delete[] scanlines;
-    fclose(file);
+    if (fclose(handle.release()) != 0)
+        throw std::runtime_error("Unable to write output file \"" + filename + "\"");
+}
+
+std::vector<std::string> writePreviews(const std::string &basename, const ImageView &image,
+        std::vector<int> sizes, const JPEGOptions &options) {
+    if (image.channels != 3)
+        throw std::runtime_error("writePreviews(): only RGB images are supported!");
+
+    std::sort(sizes.begin(), sizes.end(), std::greater<int>());
+    sizes.erase(std::unique(sizes.begin(), sizes.end()), sizes.end());
+
+    std::vector<std::string> filenames;
+    TentFilter tent;
+    ImageView level = image;
+    std::unique_ptr<float[]> data;
+    size_t maxSize = std::max(image.width, image.height);
+
+    for (size_t i=0; i<sizes.size(); ++i) {
+        if (sizes[i] <= 0 || (size_t) sizes[i] >= maxSize) {
+            cerr << "Warning: skipping the preview of size " << sizes[i]
+                 << " (the image is only " << image.width << "x" << image.height << ")" << endl;
+            continue;
+        }
+
+        float factor = sizes[i] / (float) maxSize;
+        size_t w = std::max((size_t) 1, (size_t) std::round(factor * image.width)),
+               h = std::max((size_t) 1, (size_t) std::round(factor * image.height));
+
+        data.reset(resampleImage(tent, level, w, h));
+        level = ImageView(data.get(), w, h, 3);
+
+        filenames.push_back((boost::format("%s_%i.jpg") % basename % sizes[i]).str());
+        writeJPEG(filenames.back(), level, options);
+    }
+
+    return filenames;
+}
+
+/// Escape a string for use in a JSON file
+static std::string jsonEscape(const std::string &str) {
+    std::string result;
+    for (size_t i=0; i<str.length(); ++i) {
+        char c = str[i];
+        if (c == '"' || c == '\\')
+            result += '\\';
+        if ((unsigned char) c < 0x20)
+            result += (boost::format("\\u%04x") % (int) c).str();
+        else
+            result += c;
+    }
+    return result;
+}
+
+/// Return true if the machine stores floating point values in little endian byte order
+static bool isLittleEndian() {
+    uint16_t value = 1;
+    return *((uint8_t *) &value) == 1;
+}
+
+/// Copy row 'y' of an image into a densely packed buffer (which need not be aligned)
+static void copyRow(const ImageView &image, size_t y, uint8_t *dst) {
+    size_t pixelSize = sizeof(float) * image.channels;
+    if (image.xStride == image.channels) {
+        memcpy(dst, image.pixel(0, y), pixelSize * image.width);
+    } else {
+        for (size_t x=0; x<image.width; ++x)
+            memcpy(dst + x * pixelSize, image.pixel(x, y), pixelSize);
+    }
+}
+
+/**
+ * Write a header followed by the densely packed rows of an image (optionally
+ * bottom to top). The file is sized using ftruncate() and filled in parallel
+ * through a memory mapping. If that isn't possible, the data is assembled in
+ * memory and written using a single large write.
+ */
+void writeFloatData(const std::string &filename, const std::string &header,
+        const ImageView &image, bool bottomUp) {
+    /* The header has an arbitrary length, so rows are addressed in bytes */
+    size_t h = image.height, rowBytes = sizeof(float) * image.width * image.channels,
+           dataSize = rowBytes * h, size = header.length() + dataSize;
+
+#if !defined(_WIN32)
+    if (dataSize > 0) {
+        int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1)
+            throw std::runtime_error("Unable to open output file \"" + filename + "\"");
+
+        void *ptr = MAP_FAILED;
+        if (ftruncate(fd, (off_t) size) == 0)
+            ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+        if (ptr != MAP_FAILED) {
+            memcpy(ptr, header.c_str(), header.length());
+            uint8_t *data = (uint8_t *) ptr + header.length();
+
+            #pragma omp parallel for
+            for (int y=0; y<(int) h; ++y)
+                copyRow(image, bottomUp ? h - 1 - y : y, data + y * rowBytes);
+
+            bool success = munmap(ptr, size) == 0;
+            success &= close(fd) == 0;
+            if (!success)
+                throw std::runtime_error("Unable to write output file \"" + filename + "\"");
+            return;
+        }
+        close(fd);
+    }
+#endif
+
+    std::vector<uint8_t> data(dataSize);
+    if (dataSize > 0) {
+        #pragma omp parallel for
+        for (int y=0; y<(int) h; ++y)
+            copyRow(image, bottomUp ? h - 1 - y : y, &data[0] + y * rowBytes);
+    }
+
+    FILE *file = fopen(filename.c_str(), "wb");
+    if (!file)
+        throw std::runtime_error("Unable to open output file \"" + filename + "\"");
+    bool success = fwrite(header.c_str(), 1, header.length(), file) == header.length() &&
+                   (data.empty() || fwrite(&data[0], 1, data.size(), file) == data.size());
+    success &= fclose(file) == 0;
+    if (!success)
+        throw std::runtime_error("Unable to write output file \"" + filename + "\"");
+}
+
+void writePFM(const std::string &filename, const ImageView &image) {
+    if (image.channels != 1 && image.channels != 3)
+        throw std::runtime_error("writePFM(): unknown number of channels!");
+
+    cout << "Writing " << filename << " (" << image.width << "x" << image.height << ", "
+         << image.channels << " channels, PFM) .. " << endl;
+
+    /* PFM files store the rows bottom to top, and a negative scale denotes little endian data */
+    std::string header = (boost::format("%s\n%i %i\n%s\n")
+        % (image.channels == 3 ? "PF" : "Pf") % image.width % image.height
+        % (isLittleEndian() ? "-1.0" : "1.0")).str();
+
+    writeFloatData(filename, header, image, true);
 }
 
+void writeRawFloat(const std::string &filename, const ImageView &image, const StringMap &metadata) {
+    cout << "Writing " << filename << " (" << image.width << "x" << image.height << ", "
+         << image.channels << " channels, raw float32) .. " << endl;
+
+    writeFloatData(filename, "", image, false);
+
+    /* Describe the layout in a JSON file (e.g. for numpy.memmap) */
+    std::string sidecar = filename + ".json";
+    std::ofstream os(sidecar.c_str());
+    os << "{" << endl
+       << "  \"width\": " << image.width << "," << endl
+       << "  \"height\": " << image.height << "," << endl
+       << "  \"channels\": " << image.channels << "," << endl
+       << "  \"dtype\": \"float32\"," << endl
+       << "  \"byteorder\": \"" << (isLittleEndian() ? "little" : "big") << "\"," << endl
+       << "  \"layout\": \"row-major, interleaved channels, top row first\"," << endl
+       << "  \"metadata\": {";
+
+    for (StringMap::const_iterator it = metadata.begin(); it != metadata.end(); ++it)
+        os << (it == metadata.begin() ? "" : ",") << endl
+           << "    \"" << jsonEscape(it->first) << "\": \"" << jsonEscape(it->second) << "\"";
+
+    os << endl << "  }" << endl << "}" << endl;
+
+    if (!os.good())
+        throw std::runtime_error("Unable to write the sidecar file \"" + sidecar + "\"");
+}
+
+void ExposureSeries::writeStatistics(const std::string &filename) const {
+    static const char *colorNames[] = { "red", "green", "blue", "green2" };
+
+    std::ofstream os(filename.c_str());
+    if (!os.good())
+        throw std::runtime_error("Unable to open the statistics file \"" + filename + "\"");
+
+    /* Raw value at which pixels are considered to be saturated */
+    float clip = saturation > 0 ? saturation * (whitepoint-blacklevel) + blacklevel : whitepoint;
+
+    os.precision(8);
+    os << "{" << endl
+       << "  \"width\": " << width << "," << endl
+       << "  \"height\": " << height << "," << endl
+       << "  \"blacklevel\": " << blacklevel << "," << endl
+       << "  \"whitepoint\": " << whitepoint << "," << endl
+       << "  \"saturation\": " << saturation << "," << endl
+       << "  \"exposures\": [" << endl;
+
+    for (size_t img=0; img<exposures.size(); ++img) {
+        const Exposure &exp = exposures[img];
+        os << "    {" << endl
+           << "      \"filename\": \"" << jsonEscape(exp.filename) << "\"," << endl
+           << "      \"exposure\": " << exp.exposure << "," << endl
+           << "      \"channels\": {";
+
+        bool first = true;
+        for (int color=0; color<4; ++color) {
+            const uint32_t *hist = &exp.histogram[color << 16];
+            size_t count = 0, below = 0, clipped = 0;
+            int min = -1, max = -1;
+            double sum = 0;
+
+            for (int value=0; value<0x10000; ++value) {
+                if (hist[value] == 0)
+                    continue;
+                if (min < 0)
+                    min = value;
+                max = value;
+                count += hist[value];
+                sum += (double) value * hist[value];
+                if (value < blacklevel)
+                    below += hist[value];
+                if (value >= clip)
+                    clipped += hist[value];
+            }
+
+            if (count == 0)
+                continue;
+
+            os << (first ? "" : ",") << endl
+               << "        \"" << colorNames[color] << "\": { "
+               << "\"pixels\": " << count << ", "
+               << "\"min\": " << min << ", "
+               << "\"max\": " << max << ", "
+               << "\"mean\": " << sum / count << ", "
+               << "\"median\": " << percentile(img, 0.5f, color) << ", "
+               << "\"p99.9\": " << percentile(img, 0.999f, color) << ", "
+               << "\"belowBlack\": " << below / (double) count << ", "
+               << "\"clipped\": " << clipped / (double) count << " }";
+            first = false;
+        }
+
+        os << endl << "      }" << endl
+           << "    }" << (img+1 < exposures.size() ? "," : "") << endl;
+    }
+
+    os << "  ]" << endl << "}" << endl;
+
+    if (!os.good())
+        throw std::runtime_error("Unable to write the statistics file \"" + filename + "\"");
+
+    cout << "Wrote raw data statistics to \"" << filename << "\"" << endl;
+}
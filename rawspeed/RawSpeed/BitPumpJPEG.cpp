@@ -52,19 +52,29 @@ BitPumpJPEG::BitPumpJPEG(FileMap *f, uint32 offset) :
 }
 
 __inline void BitPumpJPEG::init() {
-  memset(current_buffer,0,16);
+  mCache = 0;
   fill();
 }
 
 void BitPumpJPEG::_fill()
 {
-  // Fill in 96 bits
-  int* b = (int*)current_buffer;
-  if ((off + 12) >= size) {
-    while(mLeft <= 64 && off < size) {
-      for (int i = (mLeft>>3); i >= 0; i--)
-        current_buffer[i+1] = current_buffer[i];
-      uchar8 val = buffer[off++];
+  // Fast path: append 32 bits at once, if none of the next four bytes is 0xff
+  if (mLeft <= 24 && (off + 4) < size) {
+    uint32 v = ((uint32)buffer[off] << 24) | ((uint32)buffer[off+1] << 16) |
+               ((uint32)buffer[off+2] << 8) | (uint32)buffer[off+3];
+    if (((~v - 0x01010101) & v & 0x80808080) == 0) {
+      mCache = (mCache << 32) | v;
+      mLeft += 32;
+      off += 4;
+      return;
+    }
+  }
+
+  // Fill in bytes, until at least 49 bits are available (at most 56)
+  while (mLeft <= 48) {
+    uchar8 val = 0;
+    if (off < size) {
+      val = buffer[off++];
       if (val == 0xff) {
         if (buffer[off] == 0)
           off++;
@@ -75,33 +85,12 @@ void BitPumpJPEG::_fill()
           stuffed++;
         }
       }
-      current_buffer[0] = val;
-      mLeft+=8;
-    }
-    while (mLeft < 64) {
-      b[2] = b[1];
-      b[1] = b[0];
-      b[0] = 0;
-      mLeft +=32;
-      stuffed +=4;  //We are adding to mLeft without incrementing offset
-    }
-    return;
-  }
-  b[3] = b[0];
-  for (int i = 0; i < 12; i++) {
-    uchar8 val = buffer[off++];
-    if (val == 0xff) {
-      if (buffer[off] == 0)
-        off++;
-      else {
-        val = 0;
-        off--;
-        stuffed++;
-      }
+    } else {
+      stuffed++;  //We are adding to mLeft without incrementing offset
     }
-    current_buffer[11-i] = val;
+    mCache = (mCache << 8) | val;
+    mLeft += 8;
   }
-  mLeft+=96;
 }
 
 
@@ -460,6 +460,11 @@ void LJpegDecompressor::createHuffmanTable(HuffmanTable *htbl) {
  * and final delta result.
  * Hit rate is about 90-99% for typical LJPEGS, usually about 98%
  *
+ * Entries where the difference bits don't fit into the 14 bits
+ * (but the Huffman code does) hold the code length in bits 8-15
+ * and the SSSS length in bits 16-23, with 0xff in the low byte.
+ * HuffDecodeSlow() then only needs to fetch the difference bits.
+ *
  ************************************/
 
 void LJpegDecompressor::createBigTable(HuffmanTable *htbl) {
@@ -501,6 +506,14 @@ void LJpegDecompressor::createBigTable(HuffmanTable *htbl) {
       }
     }
 
+    /*
+    * Longer codes were matched against the zero bits appended to 'input'
+    */
+
+    if (l > bits) {
+      htbl->bigTable[i] = 0xff;
+      continue;
+    }
 
     if (rv == 16) {
       if (mDNGCompatible)
@@ -511,7 +524,11 @@ void LJpegDecompressor::createBigTable(HuffmanTable *htbl) {
     }
 
     if (rv + l > bits) {
-      htbl->bigTable[i] = 0xff;
+      // The code itself fits, only the difference bits are missing
+      if (rv <= 16)
+        htbl->bigTable[i] = 0xff | (l << 8) | (rv << 16);
+      else
+        htbl->bigTable[i] = 0xff;
       continue;
     }
 
@@ -530,10 +547,11 @@ void LJpegDecompressor::createBigTable(HuffmanTable *htbl) {
 /*
 *--------------------------------------------------------------
 *
-* HuffDecode --
+* HuffDecodeSlow --
 *
 * Taken from Figure F.16: extract next coded symbol from
-* input stream.  This should becode a macro.
+* input stream. Called by HuffDecode(), when the symbol
+* can't be decoded by a single lookup in the big table.
 *
 * Results:
 * Next coded symbol
@@ -543,24 +561,34 @@ void LJpegDecompressor::createBigTable(HuffmanTable *htbl) {
 *
 *--------------------------------------------------------------
 */
-int LJpegDecompressor::HuffDecode(HuffmanTable *htbl) {
+int LJpegDecompressor::HuffDecodeSlow(HuffmanTable *htbl) {
   int rv;
   int temp;
   int code, val;
   uint32 l;
-  /**
-   * First attempt to do complete decode, by using the first 14 bits
-   */
 
+  // The bit pump always holds at least 32 bits after a fill,
+  // which is enough for a code of up to 16 bits and its difference.
   bits->fill();
   code = bits->peekBitsNoFill(14);
+
+  /*
+  * The big table may still know the length of the code and
+  * the number of difference bits that follow.
+  */
   if (htbl->bigTable) {
     val = htbl->bigTable[code];
-    if ((val&0xff) !=  0xff) {
-      bits->skipBitsNoFill(val&0xff);
-      return val >> 8;
+    l = (val >> 8) & 0xff;
+    if (l) {
+      bits->skipBitsNoFill(l);
+      rv = val >> 16;
+      int x = bits->getBitsNoFill(rv);
+      if ((x & (1 << (rv - 1))) == 0)
+        x -= (1 << rv) - 1;
+      return x;
     }
   }
+
   /*
   * If the huffman code is less than 8 bits, we can use the fast
   * table lookup to get its value.  It's more than 8 bits about
@@ -600,13 +628,8 @@ int LJpegDecompressor::HuffDecode(HuffmanTable *htbl) {
     return -32768;
   }
 
-  // Ensure we have enough bits
-  if ((rv + l) > 24) {
-    if (rv > 16) // There is no values above 16 bits.
-      ThrowRDE("Corrupt JPEG data: Too many bits requested.");
-    else
-      bits->fill();
-  }
+  if (rv > 16) // There is no values above 16 bits.
+    ThrowRDE("Corrupt JPEG data: Too many bits requested.");
 
   /*
   * Section F.2.2.1: decode the difference and
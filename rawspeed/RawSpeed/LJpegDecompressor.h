@@ -182,7 +182,24 @@ protected:
   virtual void decodeScan() {ThrowRDE("LJpegDecompressor: No Scan decoder found");};
   JpegMarker getNextMarker(bool allowskip);
   void parseDHT();
-  int HuffDecode(HuffmanTable *htbl);
+  int HuffDecodeSlow(HuffmanTable *htbl);
+
+  /*
+  * Decode the next difference. With the big table, this is a single
+  * lookup for almost all symbols, which yields the combined length of
+  * the code and the difference bits, and the sign extended difference.
+  */
+  __inline int HuffDecode(HuffmanTable *htbl) {
+    if (htbl->bigTable) {
+      bits->fill();
+      int val = htbl->bigTable[bits->peekBitsNoFill(14)];
+      if ((val&0xff) != 0xff) {
+        bits->skipBitsNoFill(val&0xff);
+        return val >> 8;
+      }
+    }
+    return HuffDecodeSlow(htbl);
+  }
   ByteStream* input;
   BitPumpJPEG* bits;
   FileMap *mFile;
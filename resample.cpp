@@ -1,10 +1,20 @@
 #include "hdrmerge.h"
 #include <assert.h>
+#include <string.h>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define HDRMERGE_SSE 1
+#endif
 
 float TentFilter::eval(float x) const {
     return std::max(0.0f, 1.0f - std::abs(x / m_radius));
 }
 
+float BoxFilter::eval(float x) const {
+    return std::abs(x) <= m_radius ? 1.0f : 0.0f;
+}
+
 float LanczosSincFilter::eval(float x) const {
     x = std::abs(x);
 
@@ -37,9 +47,11 @@ struct Resampler {
      *      Source resolution
      * \param targetRes
      *      Desired target resolution
+     * \param offset
+     *      Optional shift of the target sample positions (in units of source samples)
      */
     Resampler(const ReconstructionFilter &rfilter,
-            int sourceRes, int targetRes) : m_sourceRes(sourceRes), m_targetRes(targetRes) {
+            int sourceRes, int targetRes, double offset = 0) : m_sourceRes(sourceRes), m_targetRes(targetRes) {
         assert(sourceRes > 0 && targetRes > 0);
         float filterRadius = rfilter.getRadius(), scale = 1.0f, invScale = 1.0f;
 
@@ -51,43 +63,69 @@ struct Resampler {
         }
 
         m_taps = (int) std::floor(filterRadius * 2);
+        m_stride = (m_taps + 3) & ~3;
+
+        /* The weights are periodic with period targetRes/gcd(sourceRes, targetRes),
+           hence only that many rows need to be precomputed (a polyphase filter bank).
+           For instance, exact 2x or 4x downsampling uses a single row of weights */
+        int divisor = sourceRes, remainder = targetRes;
+        while (remainder != 0) {
+            int temp = divisor % remainder;
+            divisor = remainder;
+            remainder = temp;
+        }
+        m_phases = targetRes / divisor;
+        int period = sourceRes / divisor;
+
         m_start = new int[targetRes];
-        m_weights = new float[m_taps * targetRes];
+        m_weights = new float[m_stride * m_phases];
         m_fastStart = 0;
         m_fastEnd = m_targetRes;
 
-        for (int i=0; i<targetRes; i++) {
+        for (int i=0; i<m_phases; i++) {
             /* Compute the fractional coordinates of the new sample i in the original coordinates */
-            float center = (i + (float) 0.5f) / targetRes * sourceRes;
+            double center = (i + 0.5) / targetRes * sourceRes + offset;
 
             /* Determine the index of the first original sample that might contribute */
-            m_start[i] = (int) std::floor(center - filterRadius + (float) 0.5f);
+            m_start[i] = (int) std::floor(center - filterRadius + 0.5);
 
-            /* Determine the size of center region, on which to run fast non condition-aware code */
-            if (m_start[i] < 0)
-                m_fastStart = std::max(m_fastStart, i + 1);
-            else if (m_start[i] + m_taps - 1 >= m_sourceRes)
-                m_fastEnd = std::min(m_fastEnd, i - 1);
-
-            float sum = 0;
+            float *weights = m_weights + i * m_stride, sum = 0;
             for (int j=0; j<m_taps; j++) {
                 /* Compute the the position where the filter should be evaluated */
-                float pos = m_start[i] + j + (float) 0.5f - center;
+                float pos = (float) (m_start[i] + j + 0.5 - center);
 
                 /* Perform the evaluation and record the weight */
                 float weight = rfilter.eval(pos * invScale);
-                m_weights[i * m_taps + j] = weight;
+                weights[j] = weight;
                 sum += weight;
             }
 
             /* Normalize the contribution of each sample */
             float normalization = 1.0f / sum;
-            for (int j=0; j<m_taps; j++) {
-                float &value = m_weights[i * m_taps + j];
-                value = (float) value * normalization;
-            }
+            for (int j=0; j<m_taps; j++)
+                weights[j] *= normalization;
+
+            /* Pad with zeros to a multiple of four taps */
+            for (int j=m_taps; j<m_stride; j++)
+                weights[j] = 0;
+        }
+
+        for (int i=m_phases; i<targetRes; i++)
+            m_start[i] = m_start[i - m_phases] + period;
+
+        /* Determine the size of center region, on which to run fast non condition-aware code */
+        for (int i=0; i<targetRes; i++) {
+            if (m_start[i] < 0)
+                m_fastStart = std::max(m_fastStart, i + 1);
+            else if (m_start[i] + m_taps - 1 >= m_sourceRes)
+                m_fastEnd = std::min(m_fastEnd, i - 1);
         }
         m_fastStart = std::min(m_fastStart, m_fastEnd);
+
+        /* Number of samples outside of the source range that can be accessed
+           (including the zero-weighted taps used for padding) */
+        m_padLeft = std::max(0, -m_start[0]);
+        m_padRight = std::max(0, m_start[targetRes-1] + m_stride - sourceRes);
     }
 
     /// Release all memory
@@ -96,6 +134,11 @@ struct Resampler {
         delete[] m_weights;
     }
 
+    /// Return the filter weights of target sample 'i'
+    inline const float *weights(int i) const {
+        return m_weights + (i % m_phases) * m_stride;
+    }
+
     /**
      * \brief Resample a multi-channel array
      *
@@ -113,7 +156,7 @@ struct Resampler {
      *     Number of channels to be resampled
      */
     void resample(const float *source, size_t sourceStride,
-            float *target, size_t targetStride, int channels) {
+            float *target, size_t targetStride, int channels) const {
         const int taps = m_taps;
         targetStride = channels * (targetStride - 1);
         sourceStride *= channels;
@@ -125,7 +168,7 @@ struct Resampler {
             for (int ch=0; ch<channels; ++ch) {
                 float result = 0;
                 for (int j=0; j<taps; ++j)
-                    result += lookup(source, start + j, sourceStride, ch) * m_weights[i * taps + j];
+                    result += lookup(source, start + j, sourceStride, ch) * weights(i)[j];
                 *target++ = result;
             }
 
@@ -139,7 +182,7 @@ struct Resampler {
             for (int ch=0; ch<channels; ++ch) {
                 float result = 0;
                 for (int j=0; j<taps; ++j)
-                    result += source[sourceStride * (start + j) + ch] * m_weights[i * taps + j];
+                    result += source[sourceStride * (start + j) + ch] * weights(i)[j];
                 *target++ = result;
             }
 
@@ -153,13 +196,110 @@ struct Resampler {
             for (int ch=0; ch<channels; ++ch) {
                 float result = 0;
                 for (int j=0; j<taps; ++j)
-                    result += lookup(source, start + j, sourceStride, ch) * m_weights[i * taps + j];
+                    result += lookup(source, start + j, sourceStride, ch) * weights(i)[j];
                 *target++ = result;
             }
 
             target += targetStride;
         }
     }
+
+    /**
+     * \brief Compute one row of an image resampled along the Y direction
+     *
+     * Target row 'i' is a weighted sum of entire source rows. The inner loop
+     * runs over contiguous columns and can be vectorized; columns are processed
+     * in blocks so that the partial sums stay in the L1 cache while the source
+     * rows stream through.
+     *
+     * \param sourceStride
+     *     Distance between consecutive source rows (in floats)
+     * \param rowSize
+     *     Number of floats per row (i.e. width * channels)
+     */
+    void resampleRow(const float *source, size_t sourceStride, size_t rowSize,
+            int i, float *target) const {
+        const size_t blockSize = 1024;
+        const int taps = m_taps;
+        const float *weights = this->weights(i);
+
+        for (size_t block=0; block<rowSize; block += blockSize) {
+            size_t size = std::min(blockSize, rowSize - block);
+            float *trg = target + block;
+
+            for (size_t k=0; k<size; ++k)
+                trg[k] = 0;
+
+            for (int j=0; j<taps; ++j) {
+                int pos = std::min(std::max(m_start[i] + j, 0), m_sourceRes - 1);
+                const float *src = source + pos * sourceStride + block;
+                float weight = weights[j];
+
+                for (size_t k=0; k<size; ++k)
+                    trg[k] += weight * src[k];
+            }
+        }
+    }
+
+#if defined(HDRMERGE_SSE)
+    /// Size of the scratch buffer needed by \ref resampleSSE()
+    size_t bufferSize(int channels) const {
+        return (channels == 1 ? 1 : 4) * (size_t) (m_padLeft + m_sourceRes + m_padRight);
+    }
+
+    /**
+     * \brief Vectorized version of \ref resample() for a densely packed
+     * row with up to four channels
+     *
+     * The row is first copied into 'buffer' (see \ref bufferSize()), where
+     * it is extended on both sides by replicating the border samples so
+     * that no boundary handling is needed. Single-channel data is resampled
+     * four taps at a time, while multi-channel data is padded to four
+     * channels per sample and each tap is processed as one SIMD operation.
+     */
+    void resampleSSE(const float *source, float *target, int channels, float *buffer) const {
+        assert(channels >= 1 && channels <= 4);
+        const int taps = m_taps, stride = m_stride, padLeft = m_padLeft;
+        const int size = padLeft + m_sourceRes + m_padRight;
+
+        if (channels == 1) {
+            for (int i=0; i<size; ++i)
+                buffer[i] = source[std::min(std::max(i - padLeft, 0), m_sourceRes - 1)];
+
+            for (int i=0; i<m_targetRes; ++i) {
+                const float *src = buffer + m_start[i] + padLeft, *w = weights(i);
+                __m128 accum = _mm_setzero_ps();
+                for (int j=0; j<stride; j += 4)
+                    accum = _mm_add_ps(accum, _mm_mul_ps(_mm_loadu_ps(src + j), _mm_loadu_ps(w + j)));
+
+                /* Horizontal sum */
+                accum = _mm_add_ps(accum, _mm_movehl_ps(accum, accum));
+                accum = _mm_add_ss(accum, _mm_shuffle_ps(accum, accum, 1));
+                _mm_store_ss(target++, accum);
+            }
+        } else {
+            for (int i=0; i<size; ++i) {
+                const float *src = source + channels * std::min(std::max(i - padLeft, 0), m_sourceRes - 1);
+                float *dst = buffer + 4*i;
+                for (int ch=0; ch<4; ++ch)
+                    dst[ch] = ch < channels ? src[ch] : 0.0f;
+            }
+
+            float result[4];
+            for (int i=0; i<m_targetRes; ++i) {
+                const float *src = buffer + 4 * (m_start[i] + padLeft), *w = weights(i);
+                __m128 accum = _mm_setzero_ps();
+                for (int j=0; j<taps; ++j)
+                    accum = _mm_add_ps(accum, _mm_mul_ps(_mm_loadu_ps(src + 4*j), _mm_set1_ps(w[j])));
+
+                _mm_storeu_ps(result, accum);
+                for (int ch=0; ch<channels; ++ch)
+                    *target++ = result[ch];
+            }
+        }
+    }
+#endif
+
 private:
     inline float lookup(const float *source, int pos, size_t stride, int offset) const {
         pos = std::min(std::max(pos, 0), m_sourceRes - 1);
@@ -172,49 +312,287 @@ private:
     int *m_start;
     float *m_weights;
     int m_fastStart, m_fastEnd;
-    int m_taps;
+    int m_taps, m_stride, m_phases;
+    int m_padLeft, m_padRight;
 };
 
 
+/**
+ * Resample 'rows' rows of a multi-channel image along the X direction
+ * (in parallel). The rows of the source and target are 'sourceStride'
+ * and 'targetStride' floats apart.
+ */
+static void resampleX(const Resampler &r, const float *source, size_t sourceStride,
+        float *target, size_t targetStride, size_t rows, int channels) {
+    #if defined(HDRMERGE_SSE)
+        if (channels <= 4) {
+            #pragma omp parallel
+            {
+                float *buffer = new float[r.bufferSize(channels)];
+
+                #pragma omp for
+                for (int y=0; y<(int) rows; ++y)
+                    r.resampleSSE(source + y * sourceStride,
+                        target + y * targetStride, channels, buffer);
+
+                delete[] buffer;
+            }
+            return;
+        }
+    #endif
+
+    #pragma omp parallel for
+    for (int y=0; y<(int) rows; ++y)
+        r.resample(source + y * sourceStride, 1, target + y * targetStride, 1, channels);
+}
+
+/**
+ * Resample a densely packed multi-channel image (releases the source buffer).
+ * The target sample positions can optionally be shifted by a fraction of a
+ * source pixel.
+ */
+static float *resample(const ReconstructionFilter &rfilter, float *data, int channels,
+        size_t width, size_t height, size_t width_t, size_t height_t,
+        double offsetX = 0, double offsetY = 0) {
+    if (width != width_t || offsetX != 0) {
+        /* Re-sample along the X direction */
+        Resampler r(rfilter, width, width_t, offsetX);
+
+        float *temp = new float[width_t * height * channels];
+        resampleX(r, data, width * channels, temp, width_t * channels, height, channels);
+
+        delete[] data;
+        data = temp;
+        width = width_t;
+    }
+
+    if (height != height_t || offsetY != 0) {
+        /* Re-sample along the Y direction */
+        Resampler r(rfilter, height, height_t, offsetY);
+
+        float *temp = new float[width_t * height_t * channels];
+        size_t rowSize = width_t * channels;
+
+        /* Process whole rows rather than columns (which would access
+           memory with a stride of one row per tap) */
+        #pragma omp parallel for schedule(static)
+        for (int y=0; y<(int) height_t; ++y)
+            r.resampleRow(data, rowSize, rowSize, y, temp + y * rowSize);
+
+        delete[] data;
+        data = temp;
+    }
+
+    return data;
+}
+
+/**
+ * Crop, resample and rotate/flip a densely packed multi-channel image in a
+ * single pass (the source buffer is left untouched). After resampling along X,
+ * the output is produced in bands of rows that are resampled along Y and then
+ * scattered to their final (possibly rotated) location tile by tile, so that
+ * each band is still in the cache when it is written.
+ */
+static float *warp(const ReconstructionFilter &rfilter, const float *data, int channels,
+        size_t width, int offs_x, int offs_y, size_t w, size_t h,
+        size_t width_t, size_t height_t, ERotateFlipType type) {
+    const size_t bandSize = 16, tileSize = 64;
+
+    /* Same conventions as rotateFlip() */
+    bool rotate_90 = type&1;
+    bool flip_x = (type & 6) == 2 || (type & 6) == 4;
+    bool flip_y = (type & 3) == 1 || (type & 3) == 2;
+
+    /* Resample the cropped region along the X direction */
+    const float *source = data + (offs_y * width + offs_x) * channels;
+    size_t sourceStride = width * channels, rowSize = width_t * channels;
+    float *temp = NULL;
+
+    if (w != width_t) {
+        Resampler r(rfilter, w, width_t);
+        temp = new float[rowSize * h];
+        resampleX(r, source, sourceStride, temp, rowSize, h, channels);
+        source = temp;
+        sourceStride = rowSize;
+    }
+
+    std::unique_ptr<Resampler> ry;
+    if (h != height_t)
+        ry.reset(new Resampler(rfilter, h, height_t));
+
+    size_t t_width = rotate_90 ? height_t : width_t;
+    float *target = new float[width_t * height_t * channels];
+    int nBands = (int) ((height_t + bandSize - 1) / bandSize);
+
+    #pragma omp parallel
+    {
+        float *band = ry.get() ? new float[bandSize * rowSize] : NULL;
+
+        #pragma omp for schedule(dynamic)
+        for (int b=0; b<nBands; ++b) {
+            size_t y0 = b * bandSize, y1 = std::min(y0 + bandSize, height_t);
+
+            /* Resample the rows of this band along Y (or refer to the source rows) */
+            const float *rows = source + y0 * sourceStride;
+            size_t rowStride = sourceStride;
+            if (band) {
+                for (size_t y=y0; y<y1; ++y)
+                    ry->resampleRow(source, sourceStride, rowSize, (int) y, band + (y-y0) * rowSize);
+                rows = band;
+                rowStride = rowSize;
+            }
+
+            /* Scatter the band to the output, one tile of columns at a time */
+            for (size_t x0=0; x0<width_t; x0 += tileSize) {
+                size_t x1 = std::min(x0 + tileSize, width_t);
+
+                for (size_t y=y0; y<y1; ++y) {
+                    size_t ty = flip_y ? height_t - 1 - y : y;
+                    size_t tx = flip_x ? width_t - 1 - x0 : x0;
+
+                    ptrdiff_t offset, step;
+                    if (rotate_90) {
+                        offset = tx * t_width + ty;
+                        step = flip_x ? -(ptrdiff_t) t_width : (ptrdiff_t) t_width;
+                    } else {
+                        offset = ty * t_width + tx;
+                        step = flip_x ? -1 : 1;
+                    }
+
+                    const float *src = rows + (y-y0) * rowStride + x0 * channels;
+                    float *dst = target + offset * channels;
+                    for (size_t x=x0; x<x1; ++x) {
+                        for (int ch=0; ch<channels; ++ch)
+                            dst[ch] = src[ch];
+                        src += channels;
+                        dst += step * channels;
+                    }
+                }
+            }
+        }
+
+        delete[] band;
+    }
+
+    delete[] temp;
+    return target;
+}
+
+float *resampleImage(const ReconstructionFilter &rfilter, const ImageView &image,
+        size_t width_t, size_t height_t) {
+    int channels = image.channels;
+    size_t width = image.width, height = image.height;
+
+    float *data = new float[width * height * channels];
+    #pragma omp parallel for
+    for (int y=0; y<(int) height; ++y) {
+        float *dst = data + y * width * channels;
+        for (size_t x=0; x<width; ++x) {
+            const float *src = image.pixel(x, y);
+            for (int c=0; c<channels; ++c)
+                *dst++ = src[c];
+        }
+    }
+
+    return ::resample(rfilter, data, channels, width, height, width_t, height_t);
+}
+
 void ExposureSeries::resample(const ReconstructionFilter &rfilter, size_t width_t, size_t height_t) {
     cout << "Resampling to " << width_t << "x" << height_t << " .." << endl;
     assert(width_t > 0 && height_t > 0);
 
-    if (width != width_t) {
-        /* Re-sample along the X direction */
-        Resampler r(rfilter, width, width_t);
+    if (image_demosaiced)
+        image_demosaiced = (float3 *) ::resample(rfilter, (float *) image_demosaiced,
+            3, width, height, width_t, height_t);
 
-        float3 *temp = new float3[width_t * height];
+    if (image_luminance)
+        image_luminance = ::resample(rfilter, image_luminance,
+            1, width, height, width_t, height_t);
 
-        #pragma omp parallel for
-        for (int y=0; y<height; ++y) {
-            const float3 *srcPtr = image_demosaiced + y * width;
-            const float3 *trgPtr = temp + y * width_t;
-            r.resample((float *) srcPtr, 1, (float *) trgPtr, 1, 3);
-        }
+    width = width_t;
+    height = height_t;
+}
+
+void ExposureSeries::warp(const ReconstructionFilter &rfilter, int offs_x, int offs_y,
+        int w, int h, size_t width_t, size_t height_t, ERotateFlipType type) {
+    cout << "Cropping, resampling and rotating to " << width_t << "x" << height_t << " .." << endl;
+    if (offs_x < 0 || offs_y < 0 || w <= 0 || h <= 0 || offs_x+w > (int) width || offs_y+h > (int) height)
+        throw std::runtime_error("warp(): selected an invalid rectangle!");
+    assert(width_t > 0 && height_t > 0);
 
+    if (image_demosaiced) {
+        float3 *temp = (float3 *) ::warp(rfilter, (float *) image_demosaiced, 3, width,
+            offs_x, offs_y, w, h, width_t, height_t, type);
         delete[] image_demosaiced;
         image_demosaiced = temp;
-        width = width_t;
     }
 
-    if (height != height_t) {
-        /* Re-sample along the Y direction */
-        Resampler r(rfilter, height, height_t);
+    if (image_luminance) {
+        float *temp = ::warp(rfilter, image_luminance, 1, width,
+            offs_x, offs_y, w, h, width_t, height_t, type);
+        delete[] image_luminance;
+        image_luminance = temp;
+    }
+
+    width = width_t;
+    height = height_t;
+    if (type & 1)
+        std::swap(width, height);
+}
+
+void ExposureSeries::demosaicDownsampled(const ReconstructionFilter &rfilter, size_t width_t, size_t height_t) {
+    cout << "Downsampling the Bayer grid to " << width_t << "x" << height_t << " .." << endl;
+    assert(width_t > 0 && height_t > 0);
+
+    for (size_t y=0; y<8; ++y)
+        for (size_t x=0; x<2; ++x)
+            if (fc(x, y) != fc(x, y & 1))
+                throw std::runtime_error("demosaicDownsampled(): only sensors with a 2x2 Bayer pattern are supported!");
 
-        float3 *temp = new float3[width_t * height_t];
+    /* Dimensions of the four color planes (ignoring an odd last row/column) */
+    size_t planeWidth = width / 2, planeHeight = height / 2;
 
+    int count[3] = { 0, 0, 0 };
+    for (int plane=0; plane<4; ++plane)
+        count[fc(plane & 1, plane >> 1)]++;
+
+    image_demosaiced = new float3[width_t * height_t];
+    memset(image_demosaiced, 0, sizeof(float3) * width_t * height_t);
+
+    for (int plane=0; plane<4; ++plane) {
+        int ox = plane & 1, oy = plane >> 1, color = fc(ox, oy);
+
+        float *data = new float[planeWidth * planeHeight];
         #pragma omp parallel for
-        for (int x=0; x<width; ++x) {
-            const float3 *srcPtr = image_demosaiced + x;
-            const float3 *trgPtr = temp + x;
+        for (int y=0; y<(int) planeHeight; ++y) {
+            const float *src = image_merged + (2*y + oy) * width + ox;
+            float *dst = data + y * planeWidth;
+            for (size_t x=0; x<planeWidth; ++x)
+                dst[x] = src[2*x];
+        }
 
-            r.resample((float *) srcPtr, width, (float *) trgPtr, width_t, 3);
+        /* The samples of this plane are displaced by half a sensor pixel (i.e.
+           a quarter of a plane sample) from the center of their 2x2 block */
+        data = ::resample(rfilter, data, 1, planeWidth, planeHeight,
+            width_t, height_t, 0.25 - 0.5*ox, 0.25 - 0.5*oy);
+
+        /* Both green planes contribute to the green channel */
+        float weight = 1.0f / count[color];
+        #pragma omp parallel for
+        for (int y=0; y<(int) height_t; ++y) {
+            const float *src = data + y * width_t;
+            float3 *dst = image_demosaiced + y * width_t;
+            for (size_t x=0; x<width_t; ++x)
+                dst[x][color] += src[x] * weight;
         }
 
-        delete[] image_demosaiced;
-        image_demosaiced = temp;
-        height = height_t;
+        delete[] data;
     }
-}
 
+    if (!keepMerged) {
+        delete[] image_merged;
+        image_merged = NULL;
+    }
+    width = width_t;
+    height = height_t;
+}